@@ -40,6 +40,16 @@ __attribute__((section(".bootloaderaddr"),used))
 const uint32_t *bootloaderaddr = BOOTLOADER_START_ADDR;
 #endif
 
+// Let the linker check the flash layout in dfu.h against the linker script.
+__asm__(
+    ".global __app_code_end\n"
+    ".set __app_code_end, " STRINGIFY(APP_CODE_END) "\n");
+#if BOOT_RECORD
+__asm__(
+    ".global __boot_record_end\n"
+    ".set __boot_record_end, " STRINGIFY(BOOT_RECORD_ADDR + PAGE_SIZE) "\n");
+#endif
+
 #if DEBUG
 // Stored in RAM so that the SoftDevice won't reject the low address.
 __attribute__((section(".softdevice_assert_handler")))
@@ -52,39 +62,92 @@ void Default_Handler(void);
 #define softdevice_assert_handler ((nrf_fault_handler_t)Default_Handler)
 #endif
 
-static void jump_to_app() {
-#if DEBUG
-    uart_disable();
-#endif
-    // Note that the SoftDevice needs to be disabled before calling this
-    // function.
-
-#if defined(DFU_TYPE_mbr)
-    *(uint32_t*)MBR_VECTOR_TABLE = SD_CODE_BASE;
-#endif
-
+__attribute__((noreturn))
+static void jump_to(const uint32_t *isr) {
     // The ISR vector contains these entries (among others):
     // 0: pointer to the end of the stack (_estack)
     // 1: the Reset_Handler
     // Note that we can't just jump to the app, we have to 'reset' the
     // stack pointer to the beginning of the stack (e.g. the highest
     // address).
-    uint32_t *sd_isr = (uint32_t*)SD_CODE_BASE;
-    uint32_t new_sp = sd_isr[0]; // load end of stack (_estack)
-    uint32_t new_pc = sd_isr[1]; // load Reset_Handler
+    uint32_t new_sp = isr[0]; // load end of stack (_estack)
+    uint32_t new_pc = isr[1]; // load Reset_Handler
+    BOOT_STAMP(BOOT_STAMP_JUMP);
     __asm__ __volatile__(
             "mov sp, %[new_sp]\n" // set stack pointer to initial stack pointer
-            "mov pc, %[new_pc]\n" // jump to SoftDevice Reset_Vector
+            "mov pc, %[new_pc]\n" // jump to Reset_Vector
             :
             : [new_sp]"r" (new_sp),
               [new_pc]"r" (new_pc));
     __builtin_unreachable();
 }
 
+static void jump_to_app() {
+#if DEBUG
+    uart_disable();
+#endif
+    // Note that the SoftDevice needs to be disabled before calling this
+    // function.
+
+    // Let the MBR forward interrupts to the SoftDevice (and from there to
+    // the app).
+    *(uint32_t*)MBR_VECTOR_TABLE = SD_CODE_BASE;
 
-uint8_t flash_buf[PAGE_SIZE];
+    // The SoftDevice starts the app.
+    jump_to((const uint32_t*)SD_CODE_BASE);
+}
+
+
+__attribute__((section(".noinit")))
+dfu_retained_t dfu_retained;
+
+DFU_BSS uint8_t flash_buf[PAGE_SIZE] __attribute__((aligned(4)));
 uint8_t *flash_buf_ptr;
 
+// Called from Reset_Handler before RAM is initialized, so that starting
+// the application costs almost no time. It must not use .data or .bss.
+void boot_app_if_valid(void) {
+    // Check for reasons DFU may be triggered:
+    //   * GPREGRET is set, which means DFU mode was requested
+    //   * The reset reason is suspicious.
+    int dfu_requested = NRF_POWER->GPREGRET != 0 || (NRF_POWER->RESETREAS & DFU_RESET_REASONS) != 0;
+#if STAGE2_BOOTLOADER && defined(DFU_TYPE_mbr)
+    // Start a second-stage bootloader configured in UICR (like with the
+    // Nordic MBR) instead of the app, but stay the recovery path when DFU
+    // mode was requested. All interrupts are forwarded to it from now on:
+    // the address is cached in the MBR vector table word, so UICR isn't
+    // read again.
+    const uint32_t *stage2_isr = (const uint32_t*)NRF_UICR->NRFFW[0];
+    if (!dfu_requested && STAGE2_ADDR_VALID((uintptr_t)stage2_isr) && stage2_isr[1] != 0xffffffff) {
+        BOOT_STAMP(BOOT_STAMP_BOOT_CHECK);
+        irq_forward_set((uintptr_t)stage2_isr);
+        jump_to(stage2_isr);
+    }
+#endif
+    // Check whether there is something that looks like a reset handler at
+    // the app ISR vector. If the page has been cleared, it will be
+    // 0xffffffff.
+    uint32_t *app_isr = (uint32_t*)APP_CODE_BASE;
+    uint32_t reset_handler = app_isr[1];
+    int app_valid = reset_handler != 0xffffffff;
+#if BOOT_RECORD
+    // When there is a boot record, trust it instead: the image was checked
+    // when the record was written, and the record is invalidated as soon
+    // as the image is modified.
+    const boot_record_t *record = (const boot_record_t*)BOOT_RECORD_ADDR;
+    if (record->magic == BOOT_RECORD_MAGIC) {
+        app_valid = record->verified != 0;
+    }
+#endif
+    int start_app = app_valid && !dfu_requested;
+    BOOT_STAMP(BOOT_STAMP_BOOT_CHECK);
+    if (start_app) {
+        // There is a valid application and the application hasn't
+        // requested for DFU mode.
+        jump_to_app();
+    }
+}
+
 void _start(void) {
 #if DEBUG
     uart_enable();
@@ -102,22 +165,10 @@ void _start(void) {
     #error Unknown DFU type
 #endif
 
-    // Check whether there is something that looks like a reset handler at
-    // the app ISR vector. If the page has been cleared, it will be
-    // 0xffffffff.
-    // Also check for other reasons DFU may be triggered:
-    //   * GPREGRET is set, which means DFU mode was requested
-    //   * The reset reason is suspicious.
-    uint32_t *app_isr = (uint32_t*)APP_CODE_BASE;
-    uint32_t reset_handler = app_isr[1];
-    if (reset_handler != 0xffffffff && NRF_POWER->GPREGRET == 0 && (NRF_POWER->RESETREAS & DFU_RESET_REASONS) == 0) {
-        // There is a valid application and the application hasn't
-        // requested for DFU mode.
-        LOG("jump to application");
-        jump_to_app();
-    } else {
-        LOG("DFU mode triggered");
-    }
+    // boot_app_if_valid() didn't start the app.
+    LOG("DFU mode triggered");
+
+    ram_zero(&_sdfu_bss, &_edfu_bss);
 
     // Clear reset reasons that we've looked at, to avoid getting stuck in
     // DFU mode.
@@ -144,11 +195,15 @@ void _start(void) {
         LOG_NUM("cannot enable SoftDevice:", err_code);
     }
 
-    // Enable IRQ for SoftDevice.
-    // Disabled as it is not necessary as all events are handled in
-    // ble_run().
-    //LOG("enable irq");
-    //sd_nvic_EnableIRQ(SWI2_IRQn);
+    // The IRQ for SoftDevice events is only enabled with IRQ_MODEL, in
+    // ble_run(). Otherwise all events are handled in the ble_run() loop.
+#if IRQ_MODEL && defined(DFU_TYPE_bootloader)
+    // The SoftDevice forwards application interrupts (including SWI2) to
+    // the application by default. Let it forward them to the DFU instead.
+    if (sd_softdevice_vector_table_base_set((uint32_t)BOOTLOADER_START_ADDR) != 0) {
+        LOG("cannot set vector table base");
+    }
+#endif
 
     flash_buf_ptr = flash_buf;
 
@@ -158,51 +213,517 @@ void _start(void) {
     ble_run();
 }
 
+// Flash operations that have been received but haven't completed yet. The
+// SoftDevice can only run one flash operation at a time, so the host may
+// send up to WINDOW_SIZE of them and they're started one after another as
+// the previous one finishes (see FLASH_OPS_SIZE).
+#define FLASH_OP_ERASE (1)
+#define FLASH_OP_WRITE (2)
+#define FLASH_OP_ERROR (3) // report an error once the preceding operations are done
+#define FLASH_OP_ERASE_APP (4) // erase all non-blank pages from dst to ERASE_APP_END
+#define FLASH_OP_COMMIT (5) // check the image against boot_record_new
+#define FLASH_OP_REPLY (6) // only reply, once the preceding operations are done
+#define FLASH_OP_READ (7) // send the flash contents from dst up to src back
+
+typedef struct {
+    uint8_t   op;
+    uint8_t   id;
+    uint8_t   reply; // last operation of a command, reply when it is done
+    uint16_t  n_words;
+    uint32_t *dst;
+    uint32_t *src; // somewhere in flash_buf
+} flash_op_t;
+
+static flash_op_t flash_ops[FLASH_OPS_SIZE];
+static uint8_t flash_ops_head;
+static uint8_t flash_ops_count;
+static uint8_t flash_buf_overrun;
+
+// Set while the commands of a batch run. Their operations don't reply, the
+// batch is replied to as a whole.
+static uint8_t batch_active;
+static uint8_t batch_error; // a command of the batch was rejected
+
+#if BOOT_RECORD
+static boot_record_t boot_record_new = {
+    .magic    = BOOT_RECORD_MAGIC,
+    .verified = 0xffffffff,
+};
+// Written when there is no record yet, and its verified field is the
+// source when clearing an existing record. In RAM, as the source of a
+// flash write.
+static boot_record_t boot_record_invalid = {
+    .magic    = BOOT_RECORD_MAGIC,
+    .length   = 0xffffffff,
+    .crc      = 0xffffffff,
+    .verified = 0,
+};
+static uint8_t boot_record_cleared; // invalidation has been queued
+
+// The image is checked in chunks of this size, one per wakeup of the event
+// loop, so that BLE events are still handled while checking a large image.
+#define COMMIT_CHUNK_SIZE (1024)
+static uint32_t commit_crc; // CRC so far, up to dst of FLASH_OP_COMMIT
+
+// CRC-32 as used by zlib, so the host can use zlib.crc32(). Start with
+// 0xffffffff and invert the result at the end.
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, uint32_t length) {
+    while (length--) {
+        crc ^= *data++;
+        for (uint8_t i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+    return crc;
+}
+#endif
+
+// Set when a flash operation failed or a command was rejected. Every
+// command after it is rejected too, until the host resends the command
+// with flash_error_id (or reconnects). Otherwise the success reply of a
+// later command would look like a cumulative acknowledgement of commands
+// that were never executed.
+static uint8_t flash_error;
+static uint8_t flash_error_id;
+
+void command_error(uint8_t id) {
+    if (!flash_error) {
+        flash_error = 1;
+        flash_error_id = id;
+    }
+    if (batch_active) {
+        // Reported once, at the end of the batch.
+        batch_error = 1;
+        return;
+    }
+    if (ERROR_REPORTING) {
+        ble_send_reply(1, id);
+    }
+}
+
+static void flash_op_done(uint8_t code) {
+    uint8_t id = flash_ops[flash_ops_head].id;
+    uint8_t reply = flash_ops[flash_ops_head].reply;
+    if (code != 0) {
+        // Drop everything queued after the failing operation. The host
+        // has to resend starting from this ID anyway.
+        flash_ops_count = 0;
+        command_error(id);
+        // A command rejected while this operation was queued came after
+        // it, so resync starts here even when the error was latched.
+        flash_error_id = id;
+        return;
+    }
+    flash_ops_head = (flash_ops_head + 1) % FLASH_OPS_SIZE;
+    flash_ops_count--;
+    if (reply) {
+        ble_send_reply(0, id);
+    }
+}
+
+#if ERASE_APP_COMMAND
+static int flash_page_blank(const uint32_t *page) {
+    for (size_t i = 0; i < PAGE_SIZE / 4; i++) {
+        if (page[i] != 0xffffffff) {
+            return 0;
+        }
+    }
+    return 1;
+}
+#endif
+
+#if ERASE_APP_COMMAND
+#if STAGE2_BOOTLOADER && defined(DFU_TYPE_mbr)
+// Erasing the app stops at a second-stage bootloader above it.
+static uintptr_t erase_app_end(void) {
+    uintptr_t stage2 = NRF_UICR->NRFFW[0];
+    if (STAGE2_ADDR_VALID(stage2)) {
+        return stage2;
+    }
+    return APP_CODE_END;
+}
+#define ERASE_APP_END (erase_app_end())
+#else
+#define ERASE_APP_END (APP_CODE_END)
+#endif
+#endif
+
+static void flash_op_start(void) {
+    while (flash_ops_count != 0) {
+        flash_op_t *op = &flash_ops[flash_ops_head];
+        uint32_t err_code = 1;
+        if (op->op == FLASH_OP_ERASE) {
+            err_code = sd_flash_page_erase((uintptr_t)op->dst / PAGE_SIZE);
+#if ERASE_APP_COMMAND
+        } else if (op->op == FLASH_OP_ERASE_APP) {
+            // Erasing takes much longer than checking, so skip pages that
+            // are already blank.
+            uintptr_t end = ERASE_APP_END;
+            while ((uintptr_t)op->dst < end && flash_page_blank(op->dst)) {
+                op->dst += PAGE_SIZE / 4;
+            }
+            if ((uintptr_t)op->dst >= end) {
+                flash_op_done(0);
+                continue;
+            }
+            err_code = sd_flash_page_erase((uintptr_t)op->dst / PAGE_SIZE);
+#endif
+        } else if (op->op == FLASH_OP_WRITE) {
+            err_code = sd_flash_write(op->dst, op->src, op->n_words);
+        } else if (op->op == FLASH_OP_REPLY) {
+            flash_op_done(0);
+            continue;
+#if FLASH_READBACK
+        } else if (op->op == FLASH_OP_READ) {
+            // All commands before it have completed, so the reply that
+            // follows the data is cumulative like any other. Continue
+            // once the SoftDevice has room for more notifications (see
+            // flash_op_poll).
+            uint32_t length = (uint8_t*)op->src - (uint8_t*)op->dst;
+            err_code = ble_read_send((const uint8_t*)op->dst, &length);
+            op->dst = (uint32_t*)((uint8_t*)op->src - length);
+            if (err_code == NRF_ERROR_RESOURCES) {
+                return;
+            }
+            if (err_code == 0) {
+                flash_op_done(0);
+                continue;
+            }
+            LOG("  read: failed to send notification");
+#endif
+#if BOOT_RECORD
+        } else if (op->op == FLASH_OP_COMMIT) {
+            // All writes before it have completed, so the image can be
+            // checked now. Check a chunk and continue after the events
+            // that are pending (see flash_op_poll), by pending SWI2 which
+            // wakes up the event loop.
+            const uint8_t *data = (const uint8_t*)op->dst;
+            const uint8_t *end = (const uint8_t*)APP_CODE_BASE + boot_record_new.length;
+            uint32_t length = end - data;
+            if (length > COMMIT_CHUNK_SIZE) {
+                length = COMMIT_CHUNK_SIZE;
+            }
+            commit_crc = crc32_update(commit_crc, data, length);
+            op->dst = (uint32_t*)(data + length);
+            if (data + length != end) {
+                sd_nvic_SetPendingIRQ(SWI2_IRQn);
+                return;
+            }
+            if (~commit_crc == boot_record_new.crc) {
+                flash_op_done(0);
+                continue;
+            }
+            LOG("  error: image doesn't match");
+#endif
+        }
+        if (err_code == 0) {
+            // Started, wait for the SoC event.
+            return;
+        }
+        if (err_code == NRF_ERROR_INTERNAL) {
+            LOG("! internal error");
+        } else if (err_code == NRF_ERROR_BUSY) {
+            LOG("! busy");
+        } else if (op->op != FLASH_OP_ERROR && op->op != FLASH_OP_COMMIT && op->op != FLASH_OP_READ) {
+            LOG("! could not start flash operation");
+        }
+        flash_op_done(1);
+    }
+}
+
+// Only erase operations are queued, so the host is probably waiting for
+// them to finish.
+static uint8_t flash_ops_only_erase(void) {
+    for (uint8_t i = 0; i < flash_ops_count; i++) {
+        uint8_t op = flash_ops[(flash_ops_head + i) % FLASH_OPS_SIZE].op;
+        if (op != FLASH_OP_ERASE && op != FLASH_OP_ERASE_APP) {
+            return 0;
+        }
+    }
+    return flash_ops_count != 0;
+}
+
+// Queue a flash operation. Only the last operation of a command has reply
+// set, and none of the operations in a batch.
+static void flash_op_push(uint8_t op, uint8_t id, uint8_t reply, uint32_t *dst, uint32_t *src, uint16_t n_words) {
+    if (flash_ops_count == FLASH_OPS_SIZE) {
+        // The host sent more than it was allowed to.
+        LOG("  error: window full");
+        command_error(id);
+        return;
+    }
+    flash_op_t *slot = &flash_ops[(flash_ops_head + flash_ops_count) % FLASH_OPS_SIZE];
+    slot->op = op;
+    slot->id = id;
+    slot->reply = reply && !batch_active;
+    slot->n_words = n_words;
+    slot->dst = dst;
+    slot->src = src;
+    flash_ops_count++;
+    if (flash_ops_count == 1) {
+        flash_op_start();
+    }
+    ble_set_idle(flash_ops_only_erase());
+}
+
+#if BATCH_COMMANDS
+// Reply to a batch once all its operations are done: let the last one
+// reply if it is still queued, or queue a reply.
+static void flash_op_reply_last(uint8_t id) {
+    if (flash_ops_count != 0) {
+        flash_op_t *op = &flash_ops[(flash_ops_head + flash_ops_count - 1) % FLASH_OPS_SIZE];
+        if (op->id == id && !op->reply) {
+            op->reply = 1;
+            return;
+        }
+    }
+    flash_op_push(FLASH_OP_REPLY, id, 1, NULL, NULL, 0);
+}
+#endif
+
+#if BOOT_RECORD || FLASH_READBACK
+// Called on every wakeup of the event loop, to continue checking the
+// image of a commit or sending back a read.
+void flash_op_poll(void) {
+    if (flash_ops_count != 0 && (flash_ops[flash_ops_head].op == FLASH_OP_COMMIT || flash_ops[flash_ops_head].op == FLASH_OP_READ)) {
+        flash_op_start();
+    }
+}
+#endif
+
+#if BOOT_RECORD
+// Whether a commit is queued. It needs boot_record_new until the record
+// has been written.
+static int commit_busy(void) {
+    for (uint8_t i = 0; i < flash_ops_count; i++) {
+        flash_op_t *op = &flash_ops[(flash_ops_head + i) % FLASH_OPS_SIZE];
+        if (op->op == FLASH_OP_COMMIT || op->src == (uint32_t*)&boot_record_new) {
+            return 1;
+        }
+    }
+    return 0;
+}
+#endif
+
+// Whether a queued write still needs the contents of flash_buf.
+static int flash_buf_busy(void) {
+    for (uint8_t i = 0; i < flash_ops_count; i++) {
+        flash_op_t *op = &flash_ops[(flash_ops_head + i) % FLASH_OPS_SIZE];
+        if (op->op == FLASH_OP_WRITE && (uint8_t*)op->src >= flash_buf && (uint8_t*)op->src < flash_buf + PAGE_SIZE) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#if BOOT_RECORD
+// Clear the verified flag of the boot record before the first command
+// that modifies the image, so that an interrupted update ends in DFU mode
+// instead of in a half-written app. When there is no record yet, write
+// one that isn't verified, or boot would fall back to checking the reset
+// handler. It shares the ID of that command, but never replies.
+static void boot_record_invalidate(uint8_t id) {
+    if (boot_record_cleared) {
+        return;
+    }
+    boot_record_cleared = 1;
+    const boot_record_t *record = (const boot_record_t*)BOOT_RECORD_ADDR;
+    if (record->magic == BOOT_RECORD_MAGIC) {
+        flash_op_push(FLASH_OP_WRITE, id, 0, (uint32_t*)&record->verified, &boot_record_invalid.verified, 1);
+    } else {
+        flash_op_push(FLASH_OP_ERASE, id, 0, (uint32_t*)BOOT_RECORD_ADDR, NULL, 0);
+        flash_op_push(FLASH_OP_WRITE, id, 0, (uint32_t*)BOOT_RECORD_ADDR, (uint32_t*)&boot_record_invalid, sizeof(boot_record_invalid) / 4);
+    }
+}
+
+// Number of operations boot_record_invalidate() may still queue, to check
+// for room before queueing anything for a command.
+#define BOOT_RECORD_INVALIDATE_OPS (boot_record_cleared ? 0 : 2)
+#else
+#define boot_record_invalidate(id)
+#define BOOT_RECORD_INVALIDATE_OPS (0)
+#endif
+
+// Reject a command that doesn't pass an input check, instead of ignoring it
+// so the host isn't left waiting for a reply.
+#define CHECK_INPUT(cond) \
+    if (INPUT_CHECKS && !(cond)) { \
+        LOG("  error: invalid command"); \
+        command_error(cmd->any.id); \
+        return; \
+    }
+
 void handle_command(uint16_t data_len, ble_command_t *cmd) {
-    // Format: command (1 byte), payload (any length, up to 19 bytes with
-    // default MTU)
+    // Format: command (1 byte), ID (1 byte), payload (any length, up to 18
+    // bytes with default MTU)
     if (INPUT_CHECKS && data_len == 0) return;
+    if (INPUT_CHECKS && data_len < 2 && cmd->any.command != COMMAND_RESET) return; // no ID to reply to
+    if (flash_error && cmd->any.command != COMMAND_RESET) {
+        if (batch_active || cmd->any.id != flash_error_id) {
+            LOG("  error: waiting for resync");
+            command_error(cmd->any.id);
+            return;
+        }
+        // The host starts again from the command that failed.
+        flash_error = 0;
+    }
     if (cmd->any.command == COMMAND_RESET) {
         LOG("command: reset");
         sd_nvic_SystemReset();
     } else if (cmd->any.command == COMMAND_ERASE_PAGE) {
-        if (INPUT_CHECKS && data_len < sizeof(cmd->erase)) return;
+        CHECK_INPUT(data_len >= sizeof(cmd->erase));
         LOG("command: erase page");
-        uint32_t err_code = sd_flash_page_erase(cmd->erase.page);
-        if (ERROR_REPORTING && err_code != 0) {
-            LOG("  error: cannot schedule page erase");
-            // Error: the erase command wasn't scheduled.
-            ble_send_reply(1);
-        }
-        if (err_code == NRF_ERROR_INTERNAL) {
-            LOG("! internal error");
-        } else if (err_code == NRF_ERROR_BUSY) {
-            LOG("! busy");
-        } else if (err_code != 0) {
-            LOG("! could not start erase of page");
-        }
+        boot_record_invalidate(cmd->erase.id);
+        flash_op_push(FLASH_OP_ERASE, cmd->erase.id, 1, (uint32_t*)((uintptr_t)cmd->erase.page * PAGE_SIZE), NULL, 0);
     } else if (cmd->any.command == COMMAND_WRITE_BUFFER) {
         LOG("command: do write");
-        if (INPUT_CHECKS && data_len < sizeof(cmd->write)) return;
-        if (INPUT_CHECKS && cmd->write.n_words > PAGE_SIZE / 4) return;
+        CHECK_INPUT(data_len >= sizeof(cmd->write));
+        CHECK_INPUT(cmd->write.n_words <= PAGE_SIZE / 4);
+        uint8_t op = FLASH_OP_WRITE;
 #if FLASH_PAGE_CHECKS
         if (cmd->write.page < APP_CODE_BASE / PAGE_SIZE || cmd->write.page >= (uint32_t)APP_CODE_END / PAGE_SIZE) {
-            if (ERROR_REPORTING) {
-                LOG("  error: page out of range");
-                ble_send_reply(1);
-            }
+            LOG("  error: page out of range");
+            op = FLASH_OP_ERROR;
+        }
+#endif
+        if (flash_buf_overrun) {
+            // Buffer data arrived while the previous write was still
+            // using the buffer, so it has been lost.
+            LOG("  error: buffer overrun");
+            op = FLASH_OP_ERROR;
+            flash_buf_overrun = 0;
+        }
+        if (op == FLASH_OP_WRITE) {
+            boot_record_invalidate(cmd->write.id);
+        }
+        if (op == FLASH_OP_WRITE || ERROR_REPORTING) {
+            flash_op_push(op, cmd->write.id, 1, (uint32_t*)((uintptr_t)cmd->write.page * PAGE_SIZE), (uint32_t*)flash_buf, cmd->write.n_words);
+        }
+        flash_buf_ptr = flash_buf;
+#if ERASE_APP_COMMAND
+    } else if (cmd->any.command == COMMAND_ERASE_APP) {
+        LOG("command: erase app");
+#if DYNAMIC_INFO_CHAR
+        uint32_t *start = (uint32_t*)SD_SIZE_GET(MBR_SIZE);
+#else
+        uint32_t *start = (uint32_t*)APP_CODE_BASE;
+#endif
+        boot_record_invalidate(cmd->any.id);
+        flash_op_push(FLASH_OP_ERASE_APP, cmd->any.id, 1, start, NULL, 0);
+#endif
+#if BOOT_RECORD
+    } else if (cmd->any.command == COMMAND_COMMIT) {
+        // Check the image once all preceding writes are done, and replace
+        // the boot record if it matches.
+        LOG("command: commit");
+        CHECK_INPUT(data_len >= sizeof(cmd->commit));
+        if (cmd->commit.length > APP_CODE_END - APP_CODE_BASE || FLASH_OPS_SIZE - flash_ops_count < 3 || commit_busy()) {
+            // Also when the previous commit is still queued: it needs
+            // boot_record_new.
+            LOG("  error: cannot commit");
+            command_error(cmd->commit.id);
             return;
         }
+        boot_record_new.length = cmd->commit.length;
+        boot_record_new.crc = cmd->commit.crc;
+        commit_crc = 0xffffffff;
+        flash_op_push(FLASH_OP_COMMIT, cmd->commit.id, 0, (uint32_t*)APP_CODE_BASE, NULL, 0);
+        flash_op_push(FLASH_OP_ERASE, cmd->commit.id, 0, (uint32_t*)BOOT_RECORD_ADDR, NULL, 0);
+        flash_op_push(FLASH_OP_WRITE, cmd->commit.id, 1, (uint32_t*)BOOT_RECORD_ADDR, (uint32_t*)&boot_record_new, sizeof(boot_record_new) / 4);
+        boot_record_cleared = 0;
 #endif
-        if (sd_flash_write((uint32_t*)((uintptr_t)cmd->write.page * PAGE_SIZE), (uint32_t*)flash_buf, cmd->write.n_words) != 0) {
-            LOG("  error: could not start page write");
+#if SCATTER_WRITES
+    } else if (cmd->any.command == COMMAND_WRITE_SG) {
+        // Write consecutive parts of the buffer to several regions of the
+        // same page. Every region is a separate flash operation, all with
+        // the same ID so there is a single reply.
+        LOG("command: scatter write");
+        CHECK_INPUT(data_len >= sizeof(cmd->write_sg));
+        uint8_t n_regions = (data_len - sizeof(cmd->write_sg)) / 4;
+        uint8_t *src = flash_buf;
+        uint8_t error = flash_buf_overrun || n_regions == 0 || n_regions + BOOT_RECORD_INVALIDATE_OPS > FLASH_OPS_SIZE - flash_ops_count;
+#if FLASH_PAGE_CHECKS
+        if (cmd->write_sg.page < APP_CODE_BASE / PAGE_SIZE || cmd->write_sg.page >= (uint32_t)APP_CODE_END / PAGE_SIZE) {
+            error = 1;
+        }
+#endif
+        for (uint8_t i = 0; i < n_regions; i++) {
+            uint16_t offset = cmd->write_sg.regions[i].offset;
+            uint16_t length = cmd->write_sg.regions[i].length;
+            src += length;
+            if (length == 0 || (offset | length) % 4 != 0 || offset + length > PAGE_SIZE || src > flash_buf_ptr) {
+                error = 1;
+            }
+        }
+        if (error) {
+            LOG("  error: invalid scatter write");
+            flash_buf_overrun = 0;
             if (ERROR_REPORTING) {
-                ble_send_reply(1);
+                flash_op_push(FLASH_OP_ERROR, cmd->write_sg.id, 1, NULL, NULL, 0);
+            }
+        } else {
+            boot_record_invalidate(cmd->write_sg.id);
+            src = flash_buf;
+            uint8_t *page = (uint8_t*)((uintptr_t)cmd->write_sg.page * PAGE_SIZE);
+            for (uint8_t i = 0; i < n_regions; i++) {
+                uint16_t offset = cmd->write_sg.regions[i].offset;
+                uint16_t length = cmd->write_sg.regions[i].length;
+                flash_op_push(FLASH_OP_WRITE, cmd->write_sg.id, i == n_regions - 1, (uint32_t*)(page + offset), (uint32_t*)src, length / 4);
+                src += length;
             }
         }
         flash_buf_ptr = flash_buf;
+#endif
+#if BATCH_COMMANDS
+    } else if (cmd->any.command == COMMAND_BATCH) {
+        // Run each command in the list, all with the ID of the batch.
+        // There is a single reply once all their flash operations are
+        // done, or an error when one of the commands was rejected (the
+        // commands after it aren't run).
+        LOG("command: batch");
+        CHECK_INPUT(data_len >= sizeof(cmd->batch));
+        uint8_t *sub = cmd->batch.commands;
+        uint8_t *end = (uint8_t*)cmd + data_len;
+        batch_active = 1;
+        batch_error = 0;
+        while (sub < end && !batch_error) {
+            uint8_t sub_len = *sub++;
+            if (sub_len < 2 || sub + sub_len > end || sub[0] == COMMAND_BATCH || sub[0] == COMMAND_READ || sub[0] == COMMAND_PING) {
+                // Malformed, nested, or a command with its own reply.
+                LOG("  error: invalid batch");
+                batch_error = 1;
+                break;
+            }
+            sub[1] = cmd->batch.id;
+            handle_command(sub_len, (ble_command_t*)sub);
+            sub += sub_len;
+        }
+        batch_active = 0;
+        if (batch_error) {
+            command_error(cmd->batch.id);
+        } else {
+            flash_op_reply_last(cmd->batch.id);
+        }
+#endif
+#if FLASH_READBACK
+    } else if (cmd->any.command == COMMAND_READ) {
+        LOG("command: read");
+        CHECK_INPUT(data_len >= sizeof(cmd->read));
+        uint32_t address = cmd->read.address;
+        uint32_t length = cmd->read.length;
+        if (address > FLASH_SIZE || length > FLASH_SIZE - address) {
+            LOG("  error: read out of range");
+            command_error(cmd->read.id);
+            return;
+        }
+        flash_op_push(FLASH_OP_READ, cmd->read.id, 1, (uint32_t*)address, (uint32_t*)(address + length), 0);
+#endif
 #if !PACKET_CHARACTERISTIC
     } else if (cmd->any.command == COMMAND_ADD_BUFFER) {
+        if (flash_buf_busy()) {
+            flash_buf_overrun = 1;
+            return;
+        }
         const uint8_t *in_start = cmd->buffer.buffer;
         uint8_t *out_end = flash_buf_ptr + (data_len - 4);
         if (INPUT_CHECKS && out_end > flash_buf + PAGE_SIZE) {
@@ -216,7 +737,7 @@ void handle_command(uint16_t data_len, ble_command_t *cmd) {
     } else if (cmd->any.command == COMMAND_PING) {
         // Only for debugging
         LOG("command: ping");
-        ble_send_reply(0);
+        ble_send_reply(0, cmd->any.id);
     } else if (cmd->any.command == COMMAND_START) {
         // Not implementing this saves ~22 bytes.
         // Note that it doesn't always work. That has probably something
@@ -229,10 +750,15 @@ void handle_command(uint16_t data_len, ble_command_t *cmd) {
 #endif
     } else {
         LOG("command: ???");
+        CHECK_INPUT(0);
     }
 }
 
 void handle_buffer(uint16_t data_len, uint8_t *data) {
+    if (flash_buf_busy()) {
+        flash_buf_overrun = 1;
+        return;
+    }
     const uint8_t *in_start = data;
     uint8_t *out_end = flash_buf_ptr + data_len;
     if (INPUT_CHECKS && out_end > flash_buf + PAGE_SIZE) {
@@ -243,17 +769,94 @@ void handle_buffer(uint16_t data_len, uint8_t *data) {
     }
 }
 
+// A new connection is a new session, the host doesn't have to resync.
+void handle_disconnect(void) {
+    flash_error = 0;
+#if FLASH_READBACK
+    // Nobody is left to send queued reads to. They stay in the queue as
+    // operations that only complete (without a reply), so the operations
+    // around them still run in order.
+    uint8_t restart = flash_ops_count != 0 && flash_ops[flash_ops_head].op == FLASH_OP_READ;
+    for (uint8_t i = 0; i < flash_ops_count; i++) {
+        flash_op_t *op = &flash_ops[(flash_ops_head + i) % FLASH_OPS_SIZE];
+        if (op->op == FLASH_OP_READ) {
+            op->op = FLASH_OP_REPLY;
+            op->reply = 0;
+        }
+    }
+    if (restart) {
+        flash_op_start();
+    }
+#endif
+}
+
+#if LONG_WRITES
+// The SoftDevice stores queued writes in the free part of flash_buf, so
+// the data doesn't need to be copied again afterwards.
+uint8_t *handle_buffer_mem(uint16_t *len) {
+    *len = flash_buf + PAGE_SIZE - flash_buf_ptr;
+    if (flash_buf_busy()) {
+        // Peer will get a 'prepare queue full' error.
+        *len = 0;
+    }
+    return flash_buf_ptr;
+}
+
+// Queued writes have been executed. The memory block given to the
+// SoftDevice now contains a list of entries (handle, offset and length as
+// 16-bit integers followed by the data), terminated by an invalid handle.
+// Move the data of each entry down over the headers, so it directly
+// follows what was already in the buffer.
+void handle_buffer_exec(uint16_t handle) {
+    const uint8_t *in = flash_buf_ptr;
+    uint8_t *out_start = flash_buf_ptr;
+    while (in + 6 <= flash_buf + PAGE_SIZE) {
+        uint16_t entry_handle = in[0] | (in[1] << 8);
+        uint16_t entry_offset = in[2] | (in[3] << 8);
+        uint16_t entry_len    = in[4] | (in[5] << 8);
+        if (entry_handle == 0) {
+            break;
+        }
+        in += 6;
+        if (entry_handle != handle) {
+            in += entry_len;
+            continue;
+        }
+        if (entry_offset != flash_buf_ptr - out_start) {
+            // Not a long write in order, the data can't be used.
+            LOG("  error: unexpected queued write offset");
+            flash_buf_overrun = 1;
+            break;
+        }
+        while (entry_len--) {
+            *flash_buf_ptr++ = *in++;
+        }
+    }
+}
+#endif
+
 void sd_evt_handler(uint32_t evt_id) {
     switch (evt_id) {
         case NRF_EVT_FLASH_OPERATION_SUCCESS:
             //LOG("sd evt: flash operation finished");
-            ble_send_reply(0);
+            if (flash_ops_count != 0) {
+                if (ERASE_APP_COMMAND && flash_ops[flash_ops_head].op == FLASH_OP_ERASE_APP) {
+                    // Continue with the next page. It is done once there
+                    // are no pages left.
+                    flash_ops[flash_ops_head].dst += PAGE_SIZE / 4;
+                } else {
+                    flash_op_done(0);
+                }
+                flash_op_start();
+            }
+            ble_set_idle(flash_ops_only_erase());
             break;
         case NRF_EVT_FLASH_OPERATION_ERROR:
             LOG("sd evt: flash operation error");
-            if (ERROR_REPORTING) {
-                ble_send_reply(1);
+            if (flash_ops_count != 0) {
+                flash_op_done(1);
             }
+            ble_set_idle(0);
             break;
         default:
             LOG_NUM("sd evt:", evt_id);
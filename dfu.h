@@ -31,11 +31,89 @@
 #if !defined(DEBUG)
 #define DEBUG                  (0)
 #endif
+
+// MBR mode has to fit in 4kB (FLASH_TEXT in nrf52_512k_s132_mbr.ld), so
+// the larger features are only enabled by default in bootloader mode (8kB).
+// In MBR mode, a second-stage bootloader can provide them instead.
+#if defined(DFU_TYPE_mbr)
+#define LARGE_FEATURES         (0)
+#else
+#define LARGE_FEATURES         (1)
+#endif
+
 #define INPUT_CHECKS           (1) // whether the received buffer is the correct length
 #define FLASH_PAGE_CHECKS      (1) // check that flash pages are within the app area
 #define ERROR_REPORTING        (1) // send error when something goes wrong (e.g. flash write fail)
 #define PACKET_CHARACTERISTIC  (1) // add a separate transport characteristic - improves speed but costs 32 bytes
 #define DYNAMIC_INFO_CHAR      (1) // load 'info' characteristic from calculated values
+#define WINDOW_SIZE            (8) // number of flash operations the host may have in flight
+#define LONG_WRITES            (LARGE_FEATURES) // accept queued (long) writes on the buffer characteristic
+#define BATCH_COMMANDS         (LARGE_FEATURES) // allow several commands in a single write
+#define SCATTER_WRITES         (LARGE_FEATURES) // write parts of the buffer to several regions of a page in one command
+#define ERASE_APP_COMMAND      (LARGE_FEATURES) // erase the whole application area in one command
+#define DEFAULT_NOTIFY         (1) // enable notifications on connect, without waiting for the CCCD write
+#define FAST_ADVERTISING       (1) // advertise at 20ms for a few seconds before slowing down
+#define DIRECTED_ADVERTISING   (1) // advertise directed to the central the application handed over
+#define PUBLISH_HANDLES        (LARGE_FEATURES) // put GATT handles in the scan response so hosts can skip discovery
+#define CONN_PARAMS_LADDER     (LARGE_FEATURES) // step down to slower intervals until the central accepts one
+#define SLAVE_LATENCY_IDLE     (LARGE_FEATURES) // use slave latency while only erasing, so flash gets more radio-free time
+#define FLASH_READBACK         (LARGE_FEATURES) // stream flash contents back as notifications on the buffer characteristic
+#define BOOT_RECORD            (LARGE_FEATURES) // boot the app based on a record written by COMMAND_COMMIT - costs a flash page
+#define BOOT_PROFILING         (0) // store DWT cycle counts of boot steps in retained RAM
+#define RAM_VECTORS            (0) // MBR mode: forward interrupts through a table in RAM that is built at boot - the app must reserve RAM_VECTORS_ADDR
+#define APP_IRQ_ROUTING        (1) // MBR mode: let the app claim some SoftDevice interrupts in its vector table
+#define MBR_COMMANDS           (1) // MBR mode: handle sd_mbr_command() calls from the app like the Nordic MBR
+#define STAGE2_BOOTLOADER      (1) // MBR mode: start the bootloader at UICR NRFFW[0] (above the app) instead of the app
+#define IRQ_MODEL              (0) // handle SoftDevice events in the SWI2 interrupt - costs ~200 bytes in bootloader mode
+
+#if LONG_WRITES && !PACKET_CHARACTERISTIC
+#error LONG_WRITES requires PACKET_CHARACTERISTIC
+#endif
+
+#if RAM_VECTORS && !defined(DFU_TYPE_mbr)
+#error RAM_VECTORS is only supported in MBR mode
+#endif
+
+#if STAGE2_BOOTLOADER && !MBR_COMMANDS
+#error STAGE2_BOOTLOADER requires MBR_COMMANDS
+#endif
+
+#if FLASH_READBACK && !PACKET_CHARACTERISTIC
+#error FLASH_READBACK requires PACKET_CHARACTERISTIC
+#endif
+
+// Size of the queue of flash operations in dfu.c: the window, and room for
+// the two operations the DFU adds by itself to invalidate the boot record.
+#define FLASH_OPS_SIZE (WINDOW_SIZE + 2)
+
+// Bits in the capabilities field of the (version 2) info characteristic.
+// Bits for features that aren't listed here are reserved and always 0.
+#define CAPABILITY_BUFFER_CHAR    (1 << 0) // buffer characteristic is present
+#define CAPABILITY_LONG_WRITES    (1 << 1) // queued writes on the buffer characteristic
+#define CAPABILITY_BATCH          (1 << 2) // COMMAND_BATCH is supported
+#define CAPABILITY_ERROR_REPORTS  (1 << 3) // failed commands are replied to
+#define CAPABILITY_READ           (1 << 4) // COMMAND_READ is supported
+#define CAPABILITY_SCATTER_WRITES (1 << 5) // COMMAND_WRITE_SG is supported
+#define CAPABILITY_ERASE_APP      (1 << 6) // COMMAND_ERASE_APP is supported
+#define CAPABILITY_COMMIT         (1 << 7) // COMMAND_COMMIT is supported
+
+#define CAPABILITIES ( \
+        (PACKET_CHARACTERISTIC ? CAPABILITY_BUFFER_CHAR   : 0) | \
+        (LONG_WRITES           ? CAPABILITY_LONG_WRITES   : 0) | \
+        (BATCH_COMMANDS        ? CAPABILITY_BATCH         : 0) | \
+        (ERROR_REPORTING       ? CAPABILITY_ERROR_REPORTS : 0) | \
+        (FLASH_READBACK        ? CAPABILITY_READ          : 0) | \
+        (SCATTER_WRITES        ? CAPABILITY_SCATTER_WRITES : 0) | \
+        (ERASE_APP_COMMAND     ? CAPABILITY_ERASE_APP     : 0) | \
+        (BOOT_RECORD           ? CAPABILITY_COMMIT        : 0))
+
+// The application can claim interrupts that are normally forwarded to the
+// SoftDevice, by putting APP_IRQ_ROUTING_MAGIC in entry 7 of its vector
+// table and a mask of IRQ numbers in entry 8. These entries are reserved
+// on the Cortex-M4. Only the IRQs in APP_IRQ_ROUTABLE can be claimed: the
+// SoftDevice doesn't need SWI1 unless radio notifications are enabled.
+#define APP_IRQ_ROUTING_MAGIC  (0x51524941) // "AIRQ"
+#define APP_IRQ_ROUTABLE       (1 << 21)    // SWI1_EGU1
 
 #define DFU_RESET_REASONS (POWER_RESETREAS_RESETPIN_Msk | POWER_RESETREAS_DOG_Msk | POWER_RESETREAS_LOCKUP_Msk)
 
@@ -48,6 +126,20 @@
 #endif
 
 extern const uint32_t _stext[];
+extern uint32_t _sdfu_bss;
+extern uint32_t _edfu_bss;
+
+// Put a variable in .dfu_bss: like .bss, but only cleared in DFU mode.
+#define DFU_BSS __attribute__((section(".dfu_bss")))
+
+void boot_app_if_valid(void);
+void ram_vectors_init(void);
+void irq_forward_set(uint32_t address);
+void ram_copy(uint32_t *dst, const uint32_t *src, const uint32_t *end);
+void ram_zero(uint32_t *dst, const uint32_t *end);
+
+#define STRINGIFY(x) STRINGIFY2(x)
+#define STRINGIFY2(x) #x
 
 #define BOOTLOADER_START_ADDR  (_stext)
 #define SD_CODE_BASE           (0x00001000)
@@ -59,10 +151,16 @@ extern const uint32_t _stext[];
 #define PAGE_SIZE              (4096)
 #define PAGE_SIZE_LOG2         (12)
 
+// The RAM vector table (with RAM_VECTORS) takes the last 256 bytes of RAM,
+// where an application usually puts its stack. The application must end
+// its RAM (and stack) below RAM_VECTORS_ADDR; the linker checks this for
+// the DFU itself (see common.ld).
 #if NRF52832_XXAA
 #define FLASH_SIZE             (0x00080000) // 512kB
+#define RAM_VECTORS_ADDR       (0x2000ff00) // last 256 bytes of RAM
 #elif NRF52840_XXAA
 #define FLASH_SIZE             (0x00100000) // 1MB
+#define RAM_VECTORS_ADDR       (0x2003ff00) // last 256 bytes of RAM
 #else
 #error Unknown nRF52 chip
 #endif
@@ -71,47 +169,134 @@ extern const uint32_t _stext[];
 #error Unknown chip
 #endif
 
+// Size of FLASH_TEXT in nrf52_512k_s132_bootloader.ld. The linker checks
+// that the application area ends below it (see common.ld).
 #if defined(DFU_TYPE_mbr)
 #define APP_BOOTLOADER_SIZE    (0)
 #else
-#define APP_BOOTLOADER_SIZE    (PAGE_SIZE)
+#define APP_BOOTLOADER_SIZE    (0x2000)
 #endif
 
+#if BOOT_RECORD
+// The last page before the bootloader holds the boot record.
+#define BOOT_RECORD_ADDR       (FLASH_SIZE - APP_BOOTLOADER_SIZE - PAGE_SIZE)
+#define BOOT_RECORD_MAGIC      (0x52544f42) // "BOTR"
+#define APP_CODE_END           (BOOT_RECORD_ADDR)
+
+// Written by COMMAND_COMMIT after the image has been checked. Until then
+// the page is erased, and the boot decision falls back to looking at the
+// reset handler of the app.
+typedef struct {
+    uint32_t magic;    // BOOT_RECORD_MAGIC
+    uint32_t length;   // length of the image in bytes, starting at APP_CODE_BASE
+    uint32_t crc;      // CRC-32 of the image
+    uint32_t verified; // cleared to 0 when the image is being modified
+} boot_record_t;
+#else
 #define APP_CODE_END           (FLASH_SIZE - APP_BOOTLOADER_SIZE)
+#endif
+
+// A second-stage bootloader (at the address in UICR.NRFFW[0]) must live in
+// the application area. It is only started when it does, and
+// COMMAND_ERASE_APP stops at it.
+#define STAGE2_ADDR_VALID(addr) ((addr) >= APP_CODE_BASE && (addr) < APP_CODE_END)
+
+// Data the application may store in RAM (at RAM_RETAINED in common.ld)
+// before resetting into DFU mode. The startup code doesn't initialize it.
+#define DFU_RETAINED_MAGIC     (0x44465552) // "RUFD"
+
+typedef struct {
+    uint32_t magic;           // DFU_RETAINED_MAGIC when the fields below are valid
+    uint8_t  peer_addr_type;  // BLE_GAP_ADDR_TYPE_*
+    uint8_t  peer_addr[6];    // address of the central that requested DFU mode
+    uint8_t  reserved;
+    uint32_t boot_cycles[3];  // BOOT_STAMP_*, written on every boot with BOOT_PROFILING
+} dfu_retained_t;
+
+extern dfu_retained_t dfu_retained;
+
+// Points during boot at which the cycle counter is recorded, counted from
+// the start of Reset_Handler.
+#define BOOT_STAMP_RAM_INIT    (0) // .data and .bss are initialized (0 when starting the app)
+#define BOOT_STAMP_BOOT_CHECK  (1) // decided whether to start the app or DFU
+#define BOOT_STAMP_JUMP        (2) // about to jump to the app (0 in DFU mode)
+
+#if BOOT_PROFILING
+#define BOOT_STAMP(n) (dfu_retained.boot_cycles[n] = DWT->CYCCNT)
+#else
+#define BOOT_STAMP(n)
+#endif
 
 #define COMMAND_RESET        (0x01) // do a reset
 #define COMMAND_ERASE_PAGE   (0x02) // start erasing this page
 #define COMMAND_WRITE_BUFFER (0x03) // start writing this page and reset buffer
 #define COMMAND_ADD_BUFFER   (0x04) // add data to write buffer
+#define COMMAND_BATCH        (0x05) // run a list of commands with a single reply
+#define COMMAND_READ         (0x06) // send back the contents of a flash range
+#define COMMAND_WRITE_SG     (0x07) // write the buffer to several regions of a page
+#define COMMAND_ERASE_APP    (0x08) // erase all application pages
+#define COMMAND_COMMIT       (0x09) // check the image and write the boot record
 #define COMMAND_PING         (0x10) // just ask a response (debug)
 #define COMMAND_START        (0x11) // start the app (debug, unreliable)
 
 typedef union {
     struct {
         uint8_t  command;
+        uint8_t  id; // echoed back in the reply
     } any;
     struct {
         uint8_t  command;
-        uint8_t  flags; // or rather: padding
+        uint8_t  id;
         uint16_t page;
     } erase; // COMMAND_ERASE_PAGE
 #if !PACKET_CHARACTERISTIC
     struct {
         uint8_t  command;
-        uint8_t  flags; // or rather: padding
+        uint8_t  id;
         uint16_t padding;
         uint8_t  buffer[16];
     } buffer; // COMMAND_ADD_BUFFER
 #endif
     struct {
         uint8_t  command;
-        uint8_t  flags; // or rather: padding
+        uint8_t  id;
         uint16_t page;
         uint16_t n_words;
     } write; // COMMAND_WRITE_BUFFER
+    struct {
+        uint8_t  command;
+        uint8_t  id;
+        uint8_t  commands[]; // length byte followed by the command, repeated
+    } batch; // COMMAND_BATCH
+    struct {
+        uint8_t  command;
+        uint8_t  id;
+        uint16_t page;
+        struct {
+            uint16_t offset; // byte offset in the page
+            uint16_t length; // in bytes
+        } regions[];
+    } write_sg; // COMMAND_WRITE_SG
+    struct __attribute__((packed)) {
+        uint8_t  command;
+        uint8_t  id;
+        uint32_t address;
+        uint32_t length;
+    } read; // COMMAND_READ
+    struct __attribute__((packed)) {
+        uint8_t  command;
+        uint8_t  id;
+        uint32_t length;
+        uint32_t crc;
+    } commit; // COMMAND_COMMIT
 } ble_command_t;
 
 void handle_command(uint16_t data_len, ble_command_t *data);
 void handle_buffer(uint16_t data_len, uint8_t *data);
+void handle_disconnect(void);
+void flash_op_poll(void);
+void command_error(uint8_t id);
+uint8_t *handle_buffer_mem(uint16_t *len);
+void handle_buffer_exec(uint16_t handle);
 
 void sd_evt_handler(uint32_t evt_id);
@@ -28,24 +28,71 @@
 #include "ble.h"
 #include "nrf_sdm.h"
 #include "nrf_mbr.h"
+#include "nrf_nvic.h"
 #include "dfu.h"
 #include "dfu_ble.h"
 #include "dfu_uart.h"
 
 #define MSEC_TO_UNITS(TIME, RESOLUTION) (((TIME) * 1000) / (RESOLUTION))
 #define UNIT_0_625_MS (625)
+#define UNIT_1_25_MS  (1250)
 #define UNIT_10_MS    (10000)
 
 #define DEVICE_NAME {'D', 'F', 'U'}
 
+#define DFU_VERSION (2)
+
+// Company ID used in the scan response. 0xffff is reserved for testing
+// and for devices without a company ID.
+#define COMPANY_ID  (0xffff)
+
 // Use the highest speed possible (lowest connection interval allowed,
 // 7.5ms), while trying to keep the connection alive by setting the
 // connection timeout to the largest allowed (4 seconds).
+// Slave latency is only used while the DFU is busy erasing, see
+// ble_set_idle.
 #define BLE_MIN_CONN_INTERVAL        BLE_GAP_CP_MIN_CONN_INTVL_MIN
 #define BLE_MAX_CONN_INTERVAL        BLE_GAP_CP_MAX_CONN_INTVL_MIN
+#if SLAVE_LATENCY_IDLE
+#define BLE_SLAVE_LATENCY            4
+#else
 #define BLE_SLAVE_LATENCY            0
+#endif
 #define BLE_CONN_SUP_TIMEOUT         MSEC_TO_UNITS(4000, UNIT_10_MS)
 
+#if CONN_PARAMS_LADDER
+// Connection intervals to ask for, fastest first. Some centrals (notably
+// Apple devices) reject 7.5ms and then stay at a much slower default, so
+// step down until the central accepts an interval.
+static const uint16_t conn_interval_ladder[] = {
+    BLE_GAP_CP_MIN_CONN_INTVL_MIN,     // 7.5ms
+    MSEC_TO_UNITS(11.25, UNIT_1_25_MS), // 11.25ms
+    MSEC_TO_UNITS(15, UNIT_1_25_MS),   // 15ms
+};
+#define CONN_INTERVAL_STEPS (sizeof(conn_interval_ladder) / sizeof(conn_interval_ladder[0]))
+
+// Index of the interval last asked for, or CONN_INTERVAL_STEPS once the
+// central has accepted one (or all have been tried).
+static uint8_t conn_interval_step;
+
+// Some centrals ignore a request instead of rejecting it, so there is no
+// update event. Step down anyway when it didn't come within this time, in
+// ticks of RTC1 (32768Hz). The timeout is compare event 0 of RTC1.
+#define CONN_INTERVAL_TIMEOUT        (2 * 32768)
+#endif
+
+// Advertise as fast as allowed right after entering DFU mode and after a
+// disconnect, so a waiting central finds the device quickly, then fall
+// back to a slower interval.
+#if FAST_ADVERTISING
+#define ADV_FAST_INTERVAL            MSEC_TO_UNITS(20, UNIT_0_625_MS)
+#define ADV_FAST_DURATION            MSEC_TO_UNITS(3000, UNIT_10_MS)
+#else
+#define ADV_FAST_INTERVAL            ADV_SLOW_INTERVAL
+#define ADV_FAST_DURATION            0
+#endif
+#define ADV_SLOW_INTERVAL            MSEC_TO_UNITS(100, UNIT_0_625_MS)
+
 // Randomly generated UUID. This UUID is the base UUID, but also the
 // service UUID.
 #define UUID_BASE {0xf4, 0x22, 0xb8, 0xef, 0x72, 0xba, 0x4b, 0xf8, 0x8c, 0xf5, 0xae, 0x83, 0x01, 0x00, 0xfc, 0x67}
@@ -81,11 +128,39 @@ static struct {
     UUID_BASE,
 };
 
+#if PUBLISH_HANDLES
+// Scan response with the attribute handles of the DFU service. They are
+// the same on every boot (for a given DFU build), so a host that trusts
+// them can start writing commands right after connecting without doing
+// service discovery. The handles are filled in by ble_init.
+static struct __attribute__((packed)) {
+    uint8_t  len;
+    uint8_t  type;
+    uint16_t company_id;
+    uint8_t  version;
+    uint16_t info_handle;
+    uint16_t command_handle;
+    uint16_t command_cccd_handle;
+    uint16_t buffer_handle;
+} scan_rsp_data = {
+    sizeof(scan_rsp_data) - 1, // everything except the length byte
+    BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA,
+    COMPANY_ID,
+    DFU_VERSION,
+};
+#endif
+
 static ble_gap_adv_data_t m_adv_data = {
     .adv_data = {
         .p_data = (uint8_t*)&adv_data,
         .len = sizeof(adv_data),
     },
+#if PUBLISH_HANDLES
+    .scan_rsp_data = {
+        .p_data = (uint8_t*)&scan_rsp_data,
+        .len = sizeof(scan_rsp_data),
+    },
+#endif
 };
 
 static ble_gap_conn_params_t gap_conn_params = {
@@ -102,6 +177,8 @@ static ble_gap_conn_sec_mode_t sec_mode = {
     .lv = 1,
 };
 
+static ble_gap_addr_t peer_addr;
+
 static ble_gap_adv_params_t m_adv_params = {
     .properties = {
         .type             = BLE_GAP_ADV_TYPE_CONNECTABLE_SCANNABLE_UNDIRECTED,
@@ -109,7 +186,7 @@ static ble_gap_adv_params_t m_adv_params = {
         .include_tx_power = 0,
     },
     .p_peer_addr = NULL,
-    .interval    = MSEC_TO_UNITS(100, UNIT_0_625_MS), // approx 100ms
+    .interval    = ADV_SLOW_INTERVAL, // updated in ble_adv_start
     .duration    = 0,    // unlimited advertisement?
     .max_adv_evts = 0,   // no max advertisement events
     .channel_mask = {0}, // ?
@@ -121,20 +198,33 @@ static ble_gap_adv_params_t m_adv_params = {
 };
 
 // Value of the 'info' characteristic.
-static struct {
+static struct __attribute__((packed)) {
     uint8_t  version;
     uint8_t  pagesize;         // as a log2, actual page size is 2^pagesize
     uint16_t number_of_pages;
     char     chip_mnemonic[4]; // chip ID
     uint16_t app_first_page;
     uint16_t app_number_of_pages;
+    // Added in version 2.
+    uint16_t capabilities;     // CAPABILITY_* bits
+    uint16_t max_mtu;          // largest ATT MTU that will be accepted
+    uint8_t  window_size;      // flash operations that may be in flight
+    uint8_t  buffer_count;     // number of page buffers
+    uint16_t mtu;              // ATT MTU of the current connection
+    uint8_t  phy;              // PHY of the current connection (BLE_GAP_PHY_*)
 } char_info_value = {
-    1,
+    DFU_VERSION,
     PAGE_SIZE_LOG2,
     FLASH_SIZE /  PAGE_SIZE, // will be updated when DYNAMIC_INFO_CHAR is set
     {'N', '5', '2', 'a'}, // nRF52, 'serial number' a (if ever needed)
     APP_CODE_BASE / PAGE_SIZE, // will be updated when DYNAMIC_INFO_CHAR is set
     (APP_CODE_END / PAGE_SIZE) - (APP_CODE_BASE / PAGE_SIZE), // same for this one
+    CAPABILITIES,
+    GATT_MTU_SIZE_DEFAULT,
+    WINDOW_SIZE,
+    1,
+    GATT_MTU_SIZE_DEFAULT,
+    BLE_GAP_PHY_1MBPS,
 };
 
 static ble_uuid_t uuid;
@@ -185,6 +275,23 @@ static ble_gatts_attr_t attr_char_write = {
     .max_len   = (GATT_MTU_SIZE_DEFAULT - 3),
 };
 
+#if PACKET_CHARACTERISTIC
+static ble_gatts_attr_t attr_char_buffer = {
+    .p_uuid    = &uuid,
+    .p_attr_md = (ble_gatts_attr_md_t*)&attr_md_writeonly,
+    .init_len  = 0,
+    .init_offs = 0,
+    .p_value   = NULL,
+#if LONG_WRITES
+    // The SoftDevice checks queued writes against this length before
+    // executing them.
+    .max_len   = BLE_GATTS_VAR_ATTR_LEN_MAX,
+#else
+    .max_len   = (GATT_MTU_SIZE_DEFAULT - 3),
+#endif
+};
+#endif
+
 static ble_gatts_char_md_t char_md_readonly = {
     .char_props.broadcast      = 0,
     .char_props.read           = 1,
@@ -220,8 +327,8 @@ static ble_gatts_char_md_t char_md_write_wo_resp = {
     .char_props.broadcast      = 0,
     .char_props.read           = 0,
     .char_props.write_wo_resp  = 1,
-    .char_props.write          = 0,
-    .char_props.notify         = 0,
+    .char_props.write          = LONG_WRITES,
+    .char_props.notify         = FLASH_READBACK,
     .char_props.indicate       = 0,
 
     .p_char_user_desc  = NULL,
@@ -232,15 +339,71 @@ static ble_gatts_char_md_t char_md_write_wo_resp = {
 };
 #endif
 
+static ble_gatts_char_handles_t char_info_handles;
 ble_gatts_char_handles_t char_command_handles;
 ble_gatts_char_handles_t char_buffer_handles;
 
 static uint16_t ble_command_conn_handle;
 
+#if SLAVE_LATENCY_IDLE
+static uint8_t ble_idle;
+#endif
+
 static uint32_t app_ram_base = APP_RAM_BASE;
 
 static uint8_t adv_handle;
 
+#if LONG_WRITES
+static ble_user_mem_block_t user_mem_block;
+#endif
+
+// Replies (pairs of status and ID) that haven't been sent yet. Several
+// are sent in one notification when they are pending at the same time.
+// A reply is either sent when a queued flash operation with its reply flag
+// completes, or right away for a command that is rejected. A read, a batch
+// and a commit each have one operation with the reply flag, so there are
+// at most FLASH_OPS_SIZE of the first kind. Rejected commands were in
+// flight too, so a host that sticks to the window never sends more than
+// WINDOW_SIZE of those before it has seen their errors.
+#define REPLY_QUEUE_SIZE (FLASH_OPS_SIZE + WINDOW_SIZE)
+static uint8_t reply_queue[REPLY_QUEUE_SIZE * 2];
+static uint8_t reply_queue_len; // in bytes
+_Static_assert(sizeof(reply_queue) <= 255, "reply_queue_len is 8 bits");
+
+static void ble_adv_configure(ble_gap_adv_data_t *adv_data) {
+    if (sd_ble_gap_adv_set_configure(&adv_handle, adv_data, &m_adv_params) != 0) {
+        LOG("cannot configure advertisment");
+    }
+    if (sd_ble_gap_adv_start(adv_handle, BLE_CONN_CFG_TAG_DEFAULT) != 0) {
+        LOG("cannot start advertisment");
+    }
+}
+
+static void ble_adv_start(uint32_t interval, uint16_t duration) {
+    m_adv_params.properties.type = BLE_GAP_ADV_TYPE_CONNECTABLE_SCANNABLE_UNDIRECTED;
+    m_adv_params.p_peer_addr = NULL;
+    m_adv_params.interval = interval;
+    m_adv_params.duration = duration;
+    ble_adv_configure(&m_adv_data);
+}
+
+// Advertise directly to the central that requested DFU mode, as left
+// behind by the application. High duty cycle directed advertising lets it
+// reconnect within a few milliseconds. It is limited to 1.28s, after which
+// normal advertising is started.
+static void ble_adv_start_directed(void) {
+    dfu_retained.magic = 0; // only use it once
+    peer_addr.addr_type = dfu_retained.peer_addr_type;
+    for (int i = 0; i < 6; i++) {
+        peer_addr.addr[i] = dfu_retained.peer_addr[i];
+    }
+    m_adv_params.properties.type = BLE_GAP_ADV_TYPE_CONNECTABLE_NONSCANNABLE_DIRECTED_HIGH_DUTY_CYCLE;
+    m_adv_params.p_peer_addr = &peer_addr;
+    m_adv_params.duration = BLE_GAP_ADV_TIMEOUT_HIGH_DUTY_MAX;
+    // Directed advertising doesn't carry any advertising data.
+    ble_adv_configure(NULL);
+}
+
 void ble_init(void) {
     LOG("enable ble");
 
@@ -251,6 +414,16 @@ void ble_init(void) {
         LOG_NUM("cannot enable BLE:", err_code);
     }
 
+#if CONN_PARAMS_LADDER
+    // Clock for the connection parameter timeout. The LFCLK is already
+    // running for the SoftDevice. The compare event pends the RTC1
+    // interrupt, which stays disabled: with SEVONPEND that wakes up
+    // sd_app_evt_wait() so the timeout is handled without other events.
+    SCB->SCR |= SCB_SCR_SEVONPEND_Msk;
+    NRF_RTC1->INTENSET = RTC_INTENSET_COMPARE0_Msk;
+    NRF_RTC1->TASKS_START = 1;
+#endif
+
     if (sd_ble_gap_device_name_set(&sec_mode,
                                    adv_data.name_value,
                                    sizeof(adv_data.name_value)) != 0) {
@@ -262,14 +435,6 @@ void ble_init(void) {
         LOG("cannot set PPCP parameters");
     }
 
-    // start advertising
-    if (sd_ble_gap_adv_set_configure(&adv_handle, &m_adv_data, &m_adv_params) != 0) {
-        LOG("cannot configure advertisment");
-    }
-    if (sd_ble_gap_adv_start(adv_handle, BLE_CONN_CFG_TAG_DEFAULT) != 0) {
-        LOG("cannot start advertisment");
-    }
-
     uuid.uuid = UUID_DFU_SERVICE;
     if (sd_ble_uuid_vs_add(&uuid_base, &uuid.type) != 0) {
         LOG("cannot add UUID");
@@ -286,16 +451,15 @@ void ble_init(void) {
     #if DYNAMIC_INFO_CHAR
     char_info_value.number_of_pages = NRF_FICR->CODESIZE;
     char_info_value.app_first_page = SD_SIZE_GET(MBR_SIZE) / PAGE_SIZE;
-    char_info_value.app_number_of_pages = char_info_value.number_of_pages - char_info_value.app_first_page;
+    char_info_value.app_number_of_pages = char_info_value.number_of_pages - char_info_value.app_first_page - (FLASH_SIZE - APP_CODE_END) / PAGE_SIZE;
     #endif
 
     // Add 'info' characteristic
     uuid.uuid = UUID_DFU_CHAR_INFO;
-    ble_gatts_char_handles_t handles;
     if (sd_ble_gatts_characteristic_add(BLE_GATT_HANDLE_INVALID,
                                         &char_md_readonly,
                                         &attr_char_info,
-                                        &handles) != 0) {
+                                        &char_info_handles) != 0) {
         LOG("cannot add info char");
     }
 
@@ -313,18 +477,145 @@ void ble_init(void) {
     uuid.uuid = UUID_DFU_CHAR_BUFFER;
     if (sd_ble_gatts_characteristic_add(BLE_GATT_HANDLE_INVALID,
                                         &char_md_write_wo_resp,
-                                        &attr_char_write,
+                                        &attr_char_buffer,
                                         &char_buffer_handles) != 0) {
         LOG("cannot add buf char");
     }
 #endif
+
+#if PUBLISH_HANDLES
+    scan_rsp_data.info_handle = char_info_handles.value_handle;
+    scan_rsp_data.command_handle = char_command_handles.value_handle;
+    scan_rsp_data.command_cccd_handle = char_command_handles.cccd_handle;
+    scan_rsp_data.buffer_handle = char_buffer_handles.value_handle;
+#endif
+
+    // Start advertising. This is done after adding the service, so the
+    // handles are known and the service is ready when a central connects.
+    if (DIRECTED_ADVERTISING && dfu_retained.magic == DFU_RETAINED_MAGIC) {
+        ble_adv_start_directed();
+    } else {
+        ble_adv_start(ADV_FAST_INTERVAL, ADV_FAST_DURATION);
+    }
+}
+
+
+
+static void ble_conn_params_request(uint16_t conn_handle) {
+    if (sd_ble_gap_conn_param_update(conn_handle, &gap_conn_params) != 0) {
+        LOG("! failed to update conn params");
+    }
+#if CONN_PARAMS_LADDER
+    NRF_RTC1->CC[0] = NRF_RTC1->COUNTER + CONN_INTERVAL_TIMEOUT;
+    NRF_RTC1->EVENTS_COMPARE[0] = 0;
+    sd_nvic_ClearPendingIRQ(RTC1_IRQn);
+#endif
+}
+
+#if CONN_PARAMS_LADDER
+// Called with the current connection interval after connecting and after
+// each connection parameter update. Ask for the next slower interval when
+// the central didn't accept the last one.
+static void ble_conn_params_check(uint16_t conn_handle, uint16_t interval) {
+    if (conn_interval_step >= CONN_INTERVAL_STEPS) {
+        return; // settled
+    }
+    if (interval <= conn_interval_ladder[conn_interval_step]) {
+        LOG("ble: conn interval accepted");
+        conn_interval_step = CONN_INTERVAL_STEPS;
+        return;
+    }
+    conn_interval_step++;
+    if (conn_interval_step < CONN_INTERVAL_STEPS) {
+        gap_conn_params.min_conn_interval = conn_interval_ladder[conn_interval_step];
+        gap_conn_params.max_conn_interval = conn_interval_ladder[conn_interval_step];
+        ble_conn_params_request(conn_handle);
+    }
 }
 
+// Called on every wakeup. There is no event when the central ignores the
+// request, so treat a request that wasn't answered in time as rejected.
+static void ble_conn_params_timeout(void) {
+    if (!NRF_RTC1->EVENTS_COMPARE[0]) {
+        return;
+    }
+    // Clear the pending interrupt too, or sd_app_evt_wait() won't sleep.
+    NRF_RTC1->EVENTS_COMPARE[0] = 0;
+    sd_nvic_ClearPendingIRQ(RTC1_IRQn);
+    if (conn_interval_step >= CONN_INTERVAL_STEPS) {
+        return;
+    }
+    LOG("ble: conn params timeout");
+    ble_conn_params_check(ble_command_conn_handle, 0xffff);
+}
+#endif
 
+// Update the runtime part of the info characteristic, after the MTU or PHY
+// of the connection changed.
+static void ble_info_update(void) {
+    ble_gatts_value_t value = {
+        .len     = sizeof(char_info_value),
+        .offset  = 0,
+        .p_value = (uint8_t*)&char_info_value,
+    };
+    if (sd_ble_gatts_value_set(BLE_CONN_HANDLE_INVALID, char_info_handles.value_handle, &value) != 0) {
+        LOG("! cannot update info char");
+    }
+}
 
-void handle_irq(void);
+#if DEFAULT_NOTIFY
+// Initialize the system attributes (CCCDs) of a new connection with
+// notifications enabled on the command characteristic. There is no bond
+// information to restore them from, and waiting for the central to write
+// the CCCD means the first replies may be lost.
+static void ble_sys_attr_init(uint16_t conn_handle) {
+    if (sd_ble_gatts_sys_attr_set(conn_handle, NULL, 0, 0) != 0) {
+        LOG("! cannot set sys attrs");
+    }
+    uint16_t cccd = BLE_GATT_HVX_NOTIFICATION;
+    ble_gatts_value_t value = {
+        .len     = sizeof(cccd),
+        .offset  = 0,
+        .p_value = (uint8_t*)&cccd,
+    };
+    if (sd_ble_gatts_value_set(conn_handle, char_command_handles.cccd_handle, &value) != 0) {
+        LOG("! cannot enable notifications");
+    }
+#if FLASH_READBACK
+    if (sd_ble_gatts_value_set(conn_handle, char_buffer_handles.cccd_handle, &value) != 0) {
+        LOG("! cannot enable notifications");
+    }
+#endif
+}
+#endif
+
+#if IRQ_MODEL
+nrf_nvic_state_t nrf_nvic_state;
+#endif
 
 void ble_run() {
+#if IRQ_MODEL
+    // Handle events in the SWI2 interrupt, as soon as the SoftDevice
+    // raises them. This way a flash operation that finished is replied to
+    // right away instead of after the next wakeup of the main loop, which
+    // is left with nothing but sleeping.
+    if (sd_nvic_SetPriority(SWI2_IRQn, 7) != 0) {
+        LOG("cannot set SWI2 priority");
+    }
+    if (sd_nvic_EnableIRQ(SWI2_IRQn) != 0) {
+        LOG("cannot enable SWI2");
+    }
+    while (1) {
+        sd_app_evt_wait();
+#if CONN_PARAMS_LADDER
+        // The connection parameter timeout only wakes up this loop.
+        // Handle it with the other events.
+        if (NRF_RTC1->EVENTS_COMPARE[0]) {
+            sd_nvic_SetPendingIRQ(SWI2_IRQn);
+        }
+#endif
+    }
+#else
     // Now wait for incoming events, using the 'thread model' (instead of
     // the IRQ model). This saves 20 bytes.
     while (1) {
@@ -332,18 +623,28 @@ void ble_run() {
         sd_app_evt_wait();
         handle_irq();
     }
+#endif
 }
 
-static uint8_t m_ble_evt_buf[sizeof(ble_evt_t) + (GATT_MTU_SIZE_DEFAULT)] __attribute__ ((aligned (4)));
+DFU_BSS static uint8_t m_ble_evt_buf[sizeof(ble_evt_t) + (GATT_MTU_SIZE_DEFAULT)] __attribute__ ((aligned (4)));
 
 static void ble_evt_handler(ble_evt_t * p_ble_evt);
+static void ble_reply_flush(void);
 
 void handle_irq(void) {
+#if BOOT_RECORD || FLASH_READBACK
+    flash_op_poll();
+#endif
+
     uint32_t evt_id;
     while (sd_evt_get(&evt_id) != NRF_ERROR_NOT_FOUND) {
         sd_evt_handler(evt_id);
     }
 
+#if CONN_PARAMS_LADDER
+    ble_conn_params_timeout();
+#endif
+
     while (1) {
         uint16_t evt_len = sizeof(m_ble_evt_buf);
         uint32_t err_code = sd_ble_evt_get(m_ble_evt_buf, &evt_len);
@@ -370,19 +671,68 @@ static void ble_evt_handler(ble_evt_t * p_ble_evt) {
         case BLE_GAP_EVT_CONNECTED: {
             LOG("ble: connected");
             uint16_t  conn_handle = p_ble_evt->evt.gatts_evt.conn_handle;
-            if (sd_ble_gap_conn_param_update(conn_handle, &gap_conn_params) != 0) {
-                LOG("! failed to update conn params");
+#if DEFAULT_NOTIFY
+            ble_sys_attr_init(conn_handle);
+#endif
+            char_info_value.mtu = GATT_MTU_SIZE_DEFAULT;
+            char_info_value.phy = BLE_GAP_PHY_1MBPS;
+            ble_info_update();
+            ble_command_conn_handle = conn_handle;
+#if SLAVE_LATENCY_IDLE
+            // Not idle to start with: the host is about to send commands.
+            ble_idle = 1;
+            ble_set_idle(0);
+#endif
+#if CONN_PARAMS_LADDER
+            // Start at the top of the ladder, unless the central already
+            // picked an interval at least as fast. Then the request only
+            // asks for the slave latency.
+            conn_interval_step = 0;
+            gap_conn_params.min_conn_interval = conn_interval_ladder[0];
+            gap_conn_params.max_conn_interval = conn_interval_ladder[0];
+            if (p_ble_evt->evt.gap_evt.params.connected.conn_params.max_conn_interval <= conn_interval_ladder[0]) {
+                conn_interval_step = CONN_INTERVAL_STEPS;
             }
+#endif
+            ble_conn_params_request(conn_handle);
             break;
         }
 
         case BLE_GAP_EVT_DISCONNECTED: {
             LOG("ble: disconnected");
-            if (sd_ble_gap_adv_start(adv_handle, BLE_CONN_CFG_TAG_DEFAULT) != 0) {
-                LOG("Could not restart advertising after disconnect.");
+            reply_queue_len = 0;
+            handle_disconnect();
+#if CONN_PARAMS_LADDER
+            conn_interval_step = CONN_INTERVAL_STEPS;
+#endif
+            ble_adv_start(ADV_FAST_INTERVAL, ADV_FAST_DURATION);
+            break;
+        }
+
+#if FAST_ADVERTISING || DIRECTED_ADVERTISING
+        case BLE_GAP_EVT_ADV_SET_TERMINATED: {
+            LOG("ble: advertising timeout");
+            if (p_ble_evt->evt.gap_evt.params.adv_set_terminated.reason != BLE_GAP_EVT_ADV_SET_TERMINATED_REASON_TIMEOUT) {
+                break;
+            }
+            if (m_adv_params.p_peer_addr != NULL) {
+                // The central didn't show up, advertise to everyone.
+                ble_adv_start(ADV_FAST_INTERVAL, ADV_FAST_DURATION);
+            } else {
+                // Fast advertising period is over.
+                ble_adv_start(ADV_SLOW_INTERVAL, 0);
             }
             break;
         }
+#endif
+
+        case BLE_GATTS_EVT_HVN_TX_COMPLETE:
+            // Replies go first, so they aren't held up by a read.
+            ble_reply_flush();
+#if FLASH_READBACK
+            flash_op_poll();
+#endif
+            break;
 
         case BLE_GATTS_EVT_HVC: {
             LOG("ble: hvc");
@@ -405,11 +755,19 @@ static void ble_evt_handler(ble_evt_t * p_ble_evt) {
             // TODO: for now all writes must be using this handle (there
             // is only one writable character). So we can avoid this check
             // (saving 12 bytes).
-            if (attr_handle == char_command_handles.value_handle) {
+            if (LONG_WRITES && p_ble_evt->evt.gatts_evt.params.write.op == BLE_GATTS_OP_EXEC_WRITE_REQ_NOW) {
+                ble_command_conn_handle = conn_handle;
+                // Data is flowing, like with a write to the buffer
+                // characteristic.
+                ble_set_idle(0);
+                handle_buffer_exec(char_buffer_handles.value_handle);
+            } else if (attr_handle == char_command_handles.value_handle) {
                 ble_command_conn_handle = conn_handle;
                 handle_command(data_len, (ble_command_t*)data);
             } else if (PACKET_CHARACTERISTIC && attr_handle == char_buffer_handles.value_handle) {
                 ble_command_conn_handle = conn_handle;
+                // Data is flowing, don't skip connection events.
+                ble_set_idle(0);
                 handle_buffer(data_len, data);
             }
             break;
@@ -417,17 +775,59 @@ static void ble_evt_handler(ble_evt_t * p_ble_evt) {
 
         case BLE_GAP_EVT_CONN_PARAM_UPDATE: {
             LOG_NUM("ble: conn param update", p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params.min_conn_interval);
+#if CONN_PARAMS_LADDER
+            ble_conn_params_check(p_ble_evt->evt.gap_evt.conn_handle,
+                                  p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params.max_conn_interval);
+#endif
+            break;
+        }
+
+#if LONG_WRITES
+        case BLE_EVT_USER_MEM_REQUEST: {
+            LOG("ble: user mem request");
+            user_mem_block.p_mem = handle_buffer_mem(&user_mem_block.len);
+            if (sd_ble_user_mem_reply(p_ble_evt->evt.common_evt.conn_handle, &user_mem_block) != 0) {
+                LOG("! cannot reply to user mem request");
+            }
             break;
         }
 
+        case BLE_EVT_USER_MEM_RELEASE:
+            LOG("ble: user mem release");
+            break;
+#endif
+
         case BLE_GATTS_EVT_SYS_ATTR_MISSING:
             LOG("ble: sys attr missing");
+#if DEFAULT_NOTIFY
+            ble_sys_attr_init(p_ble_evt->evt.gatts_evt.conn_handle);
+#endif
             break;
 
 #if NRF52
-        case BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST:
+        case BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST: {
             LOG("ble: exchange MTU request");
+            uint16_t client_mtu = p_ble_evt->evt.gatts_evt.params.exchange_mtu_request.client_rx_mtu;
             sd_ble_gatts_exchange_mtu_reply(p_ble_evt->evt.gatts_evt.conn_handle, GATT_MTU_SIZE_DEFAULT);
+            char_info_value.mtu = client_mtu < GATT_MTU_SIZE_DEFAULT ? client_mtu : GATT_MTU_SIZE_DEFAULT;
+            ble_info_update();
+            break;
+        }
+
+        case BLE_GAP_EVT_PHY_UPDATE_REQUEST: {
+            LOG("ble: phy update request");
+            ble_gap_phys_t phys = {
+                .tx_phys = BLE_GAP_PHY_AUTO,
+                .rx_phys = BLE_GAP_PHY_AUTO,
+            };
+            sd_ble_gap_phy_update(p_ble_evt->evt.gap_evt.conn_handle, &phys);
+            break;
+        }
+
+        case BLE_GAP_EVT_PHY_UPDATE:
+            LOG("ble: phy update");
+            char_info_value.phy = p_ble_evt->evt.gap_evt.params.phy_update.tx_phy;
+            ble_info_update();
             break;
 #endif
 
@@ -452,19 +852,99 @@ static void ble_evt_handler(ble_evt_t * p_ble_evt) {
     }
 }
 
-void ble_send_reply(uint8_t code) {
-    // send notification
-    uint8_t reply_ok[] = {code};
-    uint16_t reply_ok_len = sizeof(reply_ok);
-    const ble_gatts_hvx_params_t hvx_params = {
-        .handle = char_command_handles.value_handle,
-        .type = BLE_GATT_HVX_NOTIFICATION,
-        .offset = 0,
-        .p_len = &reply_ok_len,
-        .p_data = reply_ok,
+// The DFU is idle when it is only waiting for flash operations to finish
+// and doesn't expect data from the host. Let the radio skip connection
+// events then (using the slave latency of the connection), which gives the
+// SoftDevice longer periods without radio activity to erase flash in.
+// When not idle, every connection event is used so that data isn't
+// delayed.
+void ble_set_idle(uint8_t idle) {
+#if SLAVE_LATENCY_IDLE
+    if (idle == ble_idle) {
+        return;
+    }
+    ble_idle = idle;
+    ble_opt_t opt = {
+        .gap_opt.slave_latency_disable = {
+            .conn_handle = ble_command_conn_handle,
+            .disable     = !idle,
+        },
     };
-    uint32_t err_val = sd_ble_gatts_hvx(ble_command_conn_handle, &hvx_params);
-    if (err_val != 0) {
-        LOG("  notify: failed to send notification");
+    if (sd_ble_opt_set(BLE_GAP_OPT_SLAVE_LATENCY_DISABLE, &opt) != 0) {
+        LOG("! cannot change slave latency");
+    }
+#endif
+}
+
+#if FLASH_READBACK
+// Queue as many notifications with flash contents as the SoftDevice will
+// take, so that every connection event is filled. *length is decreased by
+// the number of bytes queued. Returns NRF_ERROR_RESOURCES when the rest
+// has to wait until a notification has been sent.
+uint32_t ble_read_send(const uint8_t *address, uint32_t *length) {
+    uint16_t max_len = char_info_value.mtu - 3;
+    while (*length != 0) {
+        uint16_t len = *length < max_len ? *length : max_len;
+        const ble_gatts_hvx_params_t hvx_params = {
+            .handle = char_buffer_handles.value_handle,
+            .type = BLE_GATT_HVX_NOTIFICATION,
+            .offset = 0,
+            .p_len = &len,
+            .p_data = address,
+        };
+        uint32_t err_val = sd_ble_gatts_hvx(ble_command_conn_handle, &hvx_params);
+        if (err_val != 0) {
+            return err_val;
+        }
+        address += len;
+        *length -= len;
+    }
+    return 0;
+}
+#endif
+
+// Send as many of the queued replies as fit in a notification. Called
+// again when a notification has been sent, for the replies that didn't fit
+// or for which the SoftDevice had no buffer.
+static void ble_reply_flush(void) {
+    while (reply_queue_len != 0) {
+        uint16_t len = (char_info_value.mtu - 3) & ~1;
+        if (len > reply_queue_len) {
+            len = reply_queue_len;
+        }
+        const ble_gatts_hvx_params_t hvx_params = {
+            .handle = char_command_handles.value_handle,
+            .type = BLE_GATT_HVX_NOTIFICATION,
+            .offset = 0,
+            .p_len = &len,
+            .p_data = reply_queue,
+        };
+        uint32_t err_val = sd_ble_gatts_hvx(ble_command_conn_handle, &hvx_params);
+        if (err_val == NRF_ERROR_RESOURCES) {
+            return; // wait for BLE_GATTS_EVT_HVN_TX_COMPLETE
+        }
+        if (err_val != 0) {
+            // For example, the CCCD isn't enabled (yet). Keep the replies,
+            // they're sent with the next one.
+            LOG("  notify: failed to send notification");
+            return;
+        }
+        reply_queue_len -= len;
+        for (uint8_t i = 0; i < reply_queue_len; i++) {
+            reply_queue[i] = reply_queue[i + len];
+        }
+    }
+}
+
+void ble_send_reply(uint8_t code, uint8_t id) {
+    if (reply_queue_len == sizeof(reply_queue)) {
+        // Only when the host doesn't stick to the window. Success replies
+        // are cumulative and errors are latched (see command_error), so
+        // the replies that did fit still tell it where to resume.
+        LOG("! host exceeded the window");
+        return;
     }
+    reply_queue[reply_queue_len++] = code;
+    reply_queue[reply_queue_len++] = id;
+    ble_reply_flush();
 }
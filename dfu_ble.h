@@ -30,6 +30,10 @@ void ble_init(void);
 __attribute__((noreturn))
 void ble_run(void);
 
-void ble_send_reply(uint8_t code);
+void ble_send_reply(uint8_t code, uint8_t id);
+void ble_set_idle(uint8_t idle);
+uint32_t ble_read_send(const uint8_t *address, uint32_t *length);
+
+void handle_irq(void);
 
 #define GATT_MTU_SIZE_DEFAULT (23)
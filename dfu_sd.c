@@ -25,28 +25,340 @@
 // This file contains interrupt handlers that forwards interrupts to
 // either the SoftDevice or the application, depending on the interrupt.
 
+#include "nrf52.h"
+#include "nrf_error.h"
+#include "nrf_mbr.h"
+
 #include "dfu.h"
+#include "dfu_ble.h"
 
-__attribute__((used))
+// SD/app distinction based on SoftDevice Specification. When it is listed
+// as accessible when the SoftDevice is enabled, the IRQ is forwarded to
+// the application. Otherwise it is forwarded to the SoftDevice.
+// This assumes that the application will always run with the SoftDevice
+// enabled and will never try to handle one of the 'restricted' or
+// 'blocked' interrupts.
+//
+// Entries are X(exception number, handler, kind), where the kind is SD or
+// APP, ROUTED for a SoftDevice interrupt that the application can claim,
+// SVC for the SVCall (SoftDevice, except for MBR commands) and EVT for
+// SWI2 (application, except in DFU mode with IRQ_MODEL). Both the handlers
+// and RAM_VECTORS_SD_MASK are generated from this list.
+#define FORWARDED_INTERRUPTS(X) \
+    X(11, SVC_Handler,                                  SVC) \
+    X(16, POWER_CLOCK_IRQHandler,                       SD) \
+    X(17, RADIO_IRQHandler,                             SD) \
+    X(18, UARTE0_UART0_IRQHandler,                      APP) \
+    X(19, SPIM0_SPIS0_TWIM0_TWIS0_SPI0_TWI0_IRQHandler, APP) \
+    X(20, SPIM1_SPIS1_TWIM1_TWIS1_SPI1_TWI1_IRQHandler, APP) \
+    X(21, NFCT_IRQHandler,                              APP) \
+    X(22, GPIOTE_IRQHandler,                            APP) \
+    X(23, SAADC_IRQHandler,                             APP) \
+    X(24, TIMER0_IRQHandler,                            SD) \
+    X(25, TIMER1_IRQHandler,                            APP) \
+    X(26, TIMER2_IRQHandler,                            APP) \
+    X(27, RTC0_IRQHandler,                              SD) \
+    X(28, TEMP_IRQHandler,                              SD) \
+    X(29, RNG_IRQHandler,                               SD) \
+    X(30, ECB_IRQHandler,                               SD) \
+    X(31, CCM_AAR_IRQHandler,                           SD) \
+    X(32, WDT_IRQHandler,                               APP) \
+    X(33, RTC1_IRQHandler,                              APP) \
+    X(34, QDEC_IRQHandler,                              APP) \
+    X(35, COMP_LPCOMP_IRQHandler,                       APP) \
+    X(36, SWI0_EGU0_IRQHandler,                         APP) \
+    X(37, SWI1_EGU1_IRQHandler,                         ROUTED) \
+    X(38, SWI2_EGU2_IRQHandler,                         EVT) \
+    X(39, SWI3_EGU3_IRQHandler,                         APP) \
+    X(40, SWI4_EGU4_IRQHandler,                         APP) \
+    X(41, SWI5_EGU5_IRQHandler,                         SD) \
+    X(42, TIMER3_IRQHandler,                            APP) \
+    X(43, TIMER4_IRQHandler,                            APP) \
+    X(44, PWM0_IRQHandler,                              APP) \
+    X(45, PDM_IRQHandler,                               APP) \
+    X(48, MWU_IRQHandler,                               SD) \
+    X(49, PWM1_IRQHandler,                              APP) \
+    X(50, PWM2_IRQHandler,                              APP) \
+    X(51, SPIM2_SPIS2_SPI2_IRQHandler,                  APP) \
+    X(52, RTC2_IRQHandler,                              APP) \
+    X(53, I2S_IRQHandler,                               APP) \
+    X(54, FPU_IRQHandler,                               APP)
+
+// Load the handler at base+offset (with the offset in r0) and jump to it.
+// This is a tail jump: lr still holds the exception return value, so the
+// handler returns straight to the interrupted code as if it was called
+// from the vector table, without a stack frame for the forwarder.
+#define FORWARD_INTERRUPT(base) \
+    __asm__ __volatile__( \
+            "movw r1, #:lower16:" STRINGIFY(base) "\n" \
+            "movt r1, #:upper16:" STRINGIFY(base) "\n" \
+            "ldr  r1, [r1, r0]\n" \
+            "bx   r1\n")
+
+#if defined(DFU_TYPE_mbr) && MBR_COMMANDS
+#define HANDLE_MBR_COMMANDS (1)
+#else
+#define HANDLE_MBR_COMMANDS (0)
+#endif
+
+#if HANDLE_MBR_COMMANDS && !RAM_VECTORS
+// The application may have changed the forward address with
+// SD_MBR_COMMAND_IRQ_FORWARD_ADDRESS_SET. When it isn't SD_CODE_BASE (or 0
+// in DFU mode), all interrupts go to the vector table at that address.
+// This costs an extra load from RAM and a compare and branch on every
+// interrupt compared to the constant forwarders below. With RAM_VECTORS,
+// irq_forward_set() resolves the address into the RAM vector table
+// instead, so forwarding stays a single load.
+__attribute__((naked, used))
 void handleSDInterrupt(uintptr_t offset) {
-    // Calculate the pointer to the entry in the interrupt vector table.
-    void (**ptr)() = (void(**)())((SD_CODE_BASE+offset));
-    // Load the function pointer from the vector table.
-    void (*handler)() = *ptr;
-    // Call the interrupt.
-    handler();
+    __asm__ __volatile__(
+            "movw  r1, #:lower16:" STRINGIFY(MBR_VECTOR_TABLE) "\n"
+            "movt  r1, #:upper16:" STRINGIFY(MBR_VECTOR_TABLE) "\n"
+            "ldr   r1, [r1]\n"
+            "cbnz  r1, 1f\n"
+            "mov   r1, #" STRINGIFY(SD_CODE_BASE) "\n"
+            "1:\n"
+            "ldr   r1, [r1, r0]\n"
+            "bx    r1\n");
 }
 
-__attribute__((used))
+__attribute__((naked, used))
 void handleAppInterrupt(uintptr_t offset) {
-    // Calculate the pointer to the entry in the interrupt vector table.
-    void (**ptr)() = (void(**)())((APP_CODE_BASE+offset));
-    // Load the function pointer from the vector table.
-    void (*handler)() = *ptr;
-    // Call the interrupt.
-    handler();
+    __asm__ __volatile__(
+            "movw  r1, #:lower16:" STRINGIFY(MBR_VECTOR_TABLE) "\n"
+            "movt  r1, #:upper16:" STRINGIFY(MBR_VECTOR_TABLE) "\n"
+            "ldr   r1, [r1]\n"
+            "cmp   r1, #" STRINGIFY(SD_CODE_BASE) "\n"
+            "itt   ls\n"
+            "movwls r1, #:lower16:" STRINGIFY(APP_CODE_BASE) "\n"
+            "movtls r1, #:upper16:" STRINGIFY(APP_CODE_BASE) "\n"
+            "ldr   r1, [r1, r0]\n"
+            "bx    r1\n");
+}
+#else
+// The forward address is fixed: in the bootloader build, or in MBR mode
+// without MBR_COMMANDS.
+__attribute__((naked, used))
+void handleSDInterrupt(uintptr_t offset) {
+    FORWARD_INTERRUPT(SD_CODE_BASE);
 }
 
+__attribute__((naked, used))
+void handleAppInterrupt(uintptr_t offset) {
+    FORWARD_INTERRUPT(APP_CODE_BASE);
+}
+#endif
+
+#if APP_IRQ_ROUTING && !RAM_VECTORS
+// Forward to the application if it claimed this IRQ in its vector table
+// (see APP_IRQ_ROUTING_MAGIC), otherwise to the SoftDevice. Only used for
+// the IRQs in APP_IRQ_ROUTABLE.
+__attribute__((naked, used))
+void handleRoutedInterrupt(uintptr_t offset) {
+    __asm__ __volatile__(
+            "movw r1, #:lower16:" STRINGIFY(APP_CODE_BASE) "\n"
+            "movt r1, #:upper16:" STRINGIFY(APP_CODE_BASE) "\n"
+            "ldr  r2, [r1, #28]\n" // entry 7: magic
+            "ldr  r3, [r1, #32]\n" // entry 8: IRQ mask
+            "movw r12, #:lower16:" STRINGIFY(APP_IRQ_ROUTING_MAGIC) "\n"
+            "movt r12, #:upper16:" STRINGIFY(APP_IRQ_ROUTING_MAGIC) "\n"
+            "cmp  r2, r12\n"
+            "bne  handleSDInterrupt\n"
+            "lsrs r2, r0, #2\n"     // exception number
+            "subs r2, r2, #16\n"    // IRQ number
+            "lsrs r3, r3, r2\n"
+            "lsls r3, r3, #31\n"    // bit for this IRQ
+            "beq  handleSDInterrupt\n"
+            "b    handleAppInterrupt\n");
+}
+#endif
+
+#if RAM_VECTORS
+// Number of entries in the RAM vector table: up to and including the last
+// interrupt that is forwarded (FPU).
+#define RAM_VECTORS_COUNT (55)
+
+// Let the linker check that the DFU stack ends below the table.
+__asm__(
+    ".global __ram_vectors_start\n"
+    ".set __ram_vectors_start, " STRINGIFY(RAM_VECTORS_ADDR) "\n");
+
+// Entries that are taken from the SoftDevice vector table, the rest come
+// from the application.
+#define SD_MASK_SD(number)     (1ULL << (number))
+#define SD_MASK_ROUTED(number) (1ULL << (number))
+#define SD_MASK_SVC(number)    (1ULL << (number))
+#define SD_MASK_APP(number)    (0)
+#define SD_MASK_EVT(number)    (0)
+#define SD_MASK_ENTRY(number, name, kind) | SD_MASK_##kind(number)
+#define RAM_VECTORS_SD_MASK (0 FORWARDED_INTERRUPTS(SD_MASK_ENTRY))
+
+// Resolve the handler of every interrupt once, so that forwarding an
+// interrupt is a single load from RAM instead of a load from flash (with
+// wait states) after picking the vector table. Called at every boot,
+// before the application is started or the SoftDevice is enabled. The
+// table lives at the end of RAM, which the application must leave alone.
+void ram_vectors_init(void) {
+    uint32_t *table = (uint32_t*)RAM_VECTORS_ADDR;
+    uint64_t sd_mask = RAM_VECTORS_SD_MASK;
+#if APP_IRQ_ROUTING
+    uint32_t *app_isr = (uint32_t*)APP_CODE_BASE;
+    if (app_isr[7] == APP_IRQ_ROUTING_MAGIC) {
+        sd_mask &= ~((uint64_t)(app_isr[8] & APP_IRQ_ROUTABLE) << 16);
+    }
+#endif
+    for (uint32_t i = 0; i < RAM_VECTORS_COUNT; i++) {
+        if (sd_mask & (1ULL << i)) {
+            table[i] = ((uint32_t*)SD_CODE_BASE)[i];
+        } else {
+            table[i] = ((uint32_t*)APP_CODE_BASE)[i];
+        }
+    }
+}
+
+__attribute__((naked, used))
+void handleRamInterrupt(uintptr_t offset) {
+    FORWARD_INTERRUPT(RAM_VECTORS_ADDR);
+}
+#endif
+
+#if HANDLE_MBR_COMMANDS
+static void nvmc_wait(void) {
+    while (NRF_NVMC->READY == NVMC_READY_READY_Busy) {}
+}
+
+// Whether the SoftDevice is enabled. It keeps the interrupt of RTC0, its
+// timer, enabled until it is disabled. sd_softdevice_is_enabled() can't be
+// used: this runs in the SVC handler already.
+static int softdevice_enabled(void) {
+    return NVIC_GetEnableIRQ(RTC0_IRQn);
+}
+
+// Copy a bootloader to the address in UICR, like the Nordic MBR. Unlike the
+// Nordic MBR this doesn't go through MBR_PARAM_PAGE, so a reset halfway
+// leaves a broken bootloader. The NVMC is used directly, so the SoftDevice
+// must be disabled.
+static uint32_t mbr_copy_bl(const uint32_t *src, uint32_t len) {
+    uint32_t *dst = (uint32_t*)NRF_UICR->NRFFW[0];
+    if ((uint32_t)dst == 0xffffffff || (uint32_t)dst < APP_CODE_BASE || (uint32_t)dst >= FLASH_SIZE) {
+        // No bootloader configured, or one that would overwrite the MBR
+        // or the SoftDevice.
+        return NRF_ERROR_FORBIDDEN;
+    }
+    // Written as a division so that a huge len can't wrap around.
+    if (len == 0 || (uint32_t)dst % PAGE_SIZE != 0 || len > (FLASH_SIZE - (uint32_t)dst) / 4) {
+        return NRF_ERROR_INVALID_LENGTH;
+    }
+    // The source must survive erasing the destination pages.
+    uint32_t erase_end = (uint32_t)dst + (len * 4 + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    if ((uint32_t)src < erase_end && (uint32_t)src + len * 4 > (uint32_t)dst) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    if (softdevice_enabled()) {
+        // Writing the NVMC would fault halfway.
+        return NRF_ERROR_INVALID_STATE;
+    }
+    for (uint32_t *page = dst; page < dst + len; page += PAGE_SIZE / 4) {
+        NRF_NVMC->CONFIG = NVMC_CONFIG_WEN_Een;
+        nvmc_wait();
+        NRF_NVMC->ERASEPAGE = (uint32_t)page;
+        nvmc_wait();
+    }
+    NRF_NVMC->CONFIG = NVMC_CONFIG_WEN_Wen;
+    nvmc_wait();
+    for (uint32_t i = 0; i < len; i++) {
+        dst[i] = src[i];
+        nvmc_wait();
+    }
+    NRF_NVMC->CONFIG = NVMC_CONFIG_WEN_Ren;
+    nvmc_wait();
+    // Start the new bootloader, as the Nordic MBR does.
+    NVIC_SystemReset();
+    return NRF_SUCCESS; // unreachable
+}
+
+// Forward all interrupts to the vector table at this address, or restore
+// the normal split with SD_CODE_BASE. The address is kept in the MBR
+// vector table word (or resolved into the RAM vector table), so the
+// forwarders don't need to know where it came from.
+void irq_forward_set(uint32_t address) {
+    *(uint32_t*)MBR_VECTOR_TABLE = address;
+#if RAM_VECTORS
+    if (address == SD_CODE_BASE) {
+        ram_vectors_init();
+    } else {
+        for (uint32_t i = 0; i < RAM_VECTORS_COUNT; i++) {
+            ((uint32_t*)RAM_VECTORS_ADDR)[i] = ((uint32_t*)address)[i];
+        }
+    }
+#endif
+}
+
+static uint32_t mbr_command(sd_mbr_command_t *command) {
+    switch (command->command) {
+    case SD_MBR_COMMAND_COMPARE: {
+        const uint32_t *ptr1 = command->params.compare.ptr1;
+        const uint32_t *ptr2 = command->params.compare.ptr2;
+        for (uint32_t i = 0; i < command->params.compare.len; i++) {
+            if (ptr1[i] != ptr2[i]) {
+                return NRF_ERROR_NULL;
+            }
+        }
+        return NRF_SUCCESS;
+    }
+    case SD_MBR_COMMAND_COPY_BL:
+        return mbr_copy_bl(command->params.copy_bl.bl_src, command->params.copy_bl.bl_len);
+    case SD_MBR_COMMAND_INIT_SD:
+        // Used by the Nordic bootloaders to hand interrupts back to the
+        // SoftDevice. Unlike the Nordic MBR, this only resets interrupt
+        // forwarding and doesn't call the SoftDevice reset handler.
+        irq_forward_set(SD_CODE_BASE);
+        return NRF_SUCCESS;
+    case SD_MBR_COMMAND_IRQ_FORWARD_ADDRESS_SET:
+        irq_forward_set(command->params.irq_forward_address_set.address);
+        return NRF_SUCCESS;
+    default:
+        return NRF_ERROR_NOT_SUPPORTED;
+    }
+}
+
+// Called from SVC_Handler with the exception stack frame of an
+// sd_mbr_command() call. Its return value replaces the stacked r0.
+__attribute__((used))
+void mbr_command_svc(uint32_t *frame) {
+    frame[0] = mbr_command((sd_mbr_command_t*)frame[0]);
+}
+
+#if RAM_VECTORS
+#define SVC_FORWARD "handleRamInterrupt"
+#else
+#define SVC_FORWARD "handleSDInterrupt"
+#endif
+
+// The SVC number is the immediate in the svc instruction just before the
+// stacked return address. sd_mbr_command() (MBR_SVC_BASE) is handled here,
+// everything else is forwarded to the SoftDevice. Both are tail jumps.
+__attribute__((naked))
+void SVC_Handler(void) {
+    __asm__ __volatile__(
+            "tst   lr, #4\n"
+            "ite   eq\n"
+            "mrseq r1, msp\n"
+            "mrsne r1, psp\n"
+            "ldr   r2, [r1, #24]\n" // stacked pc
+            "ldrb  r2, [r2, #-2]\n" // SVC number
+            "cmp   r2, %[mbr_svc]\n"
+            "itt   eq\n"
+            "moveq r0, r1\n"
+            "beq   mbr_command_svc\n"
+            "movs  r0, %[offset]\n"
+            "b     " SVC_FORWARD "\n"
+            :
+            : [mbr_svc]"I" (MBR_SVC_BASE),
+              [offset]"I" (11*4));
+}
+#endif
+
 // These macros define a single forwarding interrupt handler in the
 // smallest amount of code possible, because this handler must be repeated
 // for every interrupt.
@@ -58,6 +370,18 @@ void handleAppInterrupt(uintptr_t offset) {
 //
 // The 'offset' parameter here is the offset from SD_CODE_BASE or
 // APP_CODE_BASE where the interrupt handler pointer lives.
+//
+// With RAM_VECTORS, both kinds jump to handleRamInterrupt instead, where the
+// offset is into the RAM vector table.
+#if RAM_VECTORS
+#define DEFINE_SD_HANDLER(number, name) \
+    __attribute__((naked)) \
+    void name (void) { \
+        __asm__ __volatile__("movs r0, %[offset]\nb.n handleRamInterrupt" : : [offset]"I" (number*4)); \
+    }
+#define DEFINE_APP_HANDLER DEFINE_SD_HANDLER
+#define DEFINE_ROUTED_HANDLER DEFINE_SD_HANDLER
+#else
 #define DEFINE_SD_HANDLER(number, name) \
     __attribute__((naked)) \
     void name (void) { \
@@ -68,48 +392,43 @@ void handleAppInterrupt(uintptr_t offset) {
     void name (void) { \
         __asm__ __volatile__("movs r0, %[offset]\nb.n handleAppInterrupt" : : [offset]"I" (number*4)); \
     }
+#if APP_IRQ_ROUTING
+#define DEFINE_ROUTED_HANDLER(number, name) \
+    __attribute__((naked)) \
+    void name (void) { \
+        __asm__ __volatile__("movs r0, %[offset]\nb.n handleRoutedInterrupt" : : [offset]"I" (number*4)); \
+    }
+#else
+#define DEFINE_ROUTED_HANDLER DEFINE_SD_HANDLER
+#endif
+#endif
 
-// SD/app distinction based on SoftDevice Specification. When it is listed
-// as accessible when the SoftDevice is enabled, the IRQ is forwarded to
-// the application. Otherwise it is forwarded to the SoftDevice.
-// This assumes that the application will always run with the SoftDevice
-// enabled and will never try to handle one of the 'restricted' or
-// 'blocked' interrupts.
-DEFINE_SD_HANDLER(11, SVC_Handler)
-DEFINE_SD_HANDLER(16, POWER_CLOCK_IRQHandler)
-DEFINE_SD_HANDLER(17, RADIO_IRQHandler)
-DEFINE_APP_HANDLER(18, UARTE0_UART0_IRQHandler)
-DEFINE_APP_HANDLER(19, SPIM0_SPIS0_TWIM0_TWIS0_SPI0_TWI0_IRQHandler)
-DEFINE_APP_HANDLER(20, SPIM1_SPIS1_TWIM1_TWIS1_SPI1_TWI1_IRQHandler)
-DEFINE_APP_HANDLER(21, NFCT_IRQHandler)
-DEFINE_APP_HANDLER(22, GPIOTE_IRQHandler)
-DEFINE_APP_HANDLER(23, SAADC_IRQHandler)
-DEFINE_SD_HANDLER(24, TIMER0_IRQHandler)
-DEFINE_APP_HANDLER(25, TIMER1_IRQHandler)
-DEFINE_APP_HANDLER(26, TIMER2_IRQHandler)
-DEFINE_SD_HANDLER(27, RTC0_IRQHandler)
-DEFINE_SD_HANDLER(28, TEMP_IRQHandler)
-DEFINE_SD_HANDLER(29, RNG_IRQHandler)
-DEFINE_SD_HANDLER(30, ECB_IRQHandler)
-DEFINE_SD_HANDLER(31, CCM_AAR_IRQHandler)
-DEFINE_APP_HANDLER(32, WDT_IRQHandler)
-DEFINE_APP_HANDLER(33, RTC1_IRQHandler)
-DEFINE_APP_HANDLER(34, QDEC_IRQHandler)
-DEFINE_APP_HANDLER(35, COMP_LPCOMP_IRQHandler)
-DEFINE_APP_HANDLER(36, SWI0_EGU0_IRQHandler)
-DEFINE_SD_HANDLER(37, SWI1_EGU1_IRQHandler)
-DEFINE_APP_HANDLER(38, SWI2_EGU2_IRQHandler)
-DEFINE_APP_HANDLER(39, SWI3_EGU3_IRQHandler)
-DEFINE_APP_HANDLER(40, SWI4_EGU4_IRQHandler)
-DEFINE_SD_HANDLER(41, SWI5_EGU5_IRQHandler)
-DEFINE_APP_HANDLER(42, TIMER3_IRQHandler)
-DEFINE_APP_HANDLER(43, TIMER4_IRQHandler)
-DEFINE_APP_HANDLER(44, PWM0_IRQHandler)
-DEFINE_APP_HANDLER(45, PDM_IRQHandler)
-DEFINE_SD_HANDLER(48, MWU_IRQHandler)
-DEFINE_APP_HANDLER(49, PWM1_IRQHandler)
-DEFINE_APP_HANDLER(50, PWM2_IRQHandler)
-DEFINE_APP_HANDLER(51, SPIM2_SPIS2_SPI2_IRQHandler)
-DEFINE_APP_HANDLER(52, RTC2_IRQHandler)
-DEFINE_APP_HANDLER(53, I2S_IRQHandler)
-DEFINE_APP_HANDLER(54, FPU_IRQHandler)
+#if HANDLE_MBR_COMMANDS
+#define DEFINE_SVC_HANDLER(number, name) // SVC_Handler is defined above
+#else
+#define DEFINE_SVC_HANDLER DEFINE_SD_HANDLER
+#endif
+
+#if IRQ_MODEL
+#define DEFINE_EVT_HANDLER(number, name) // SWI2_EGU2_IRQHandler is defined below
+
+// SoftDevice events are signalled with SWI2. In DFU mode they're for the
+// DFU itself, otherwise for the application. The MBR vector table word is
+// 0 while in DFU mode (see _start) and points to the SoftDevice once the
+// application has been started.
+void SWI2_EGU2_IRQHandler(void) {
+#if defined(DFU_TYPE_mbr)
+    if (*(uint32_t*)MBR_VECTOR_TABLE != 0) {
+        // Not a tail jump, the app handler returns here.
+        handleAppInterrupt(38*4);
+        return;
+    }
+#endif
+    handle_irq();
+}
+#else
+#define DEFINE_EVT_HANDLER DEFINE_APP_HANDLER
+#endif
+
+#define DEFINE_HANDLER(number, name, kind) DEFINE_##kind##_HANDLER(number, name)
+FORWARDED_INTERRUPTS(DEFINE_HANDLER)
@@ -0,0 +1,218 @@
+#!/usr/bin/python
+#
+# The MIT License (MIT)
+#
+# Copyright (c) 2018 Ayke van Laethem
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+
+# Measure the cost of interrupt forwarding (and of booting into the
+# application) by running the DFU in an emulator. It loads build/dfu.elf,
+# fills the SoftDevice and application vector tables with pointers to
+# marker addresses, and runs every entry of __Vectors until it arrives at one
+# of the markers.
+#
+# Cycles are modeled, not measured: every instruction takes 1 cycle, every
+# memory access 1 more (plus the given number of wait states for flash), and
+# a taken branch 2 more for refilling the pipeline. Hardware exception entry
+# (12 cycles) is the same with or without the DFU and is not included.
+#
+# Requires the unicorn Python package.
+
+import argparse
+import struct
+import sys
+
+import unicorn
+from unicorn import arm_const
+
+SD_CODE_BASE  = 0x00001000
+APP_CODE_BASE = 0x00026000
+FLASH_SIZE    = 0x00080000
+RAM_BASE      = 0x20000000
+RAM_SIZE      = 0x00010000
+MARKER_SD     = 0x30000000 # handlers in the fake SoftDevice vector table
+MARKER_APP    = 0x30001000 # handlers in the fake application vector table
+MARKER_SIZE   = 0x00002000
+EXC_RETURN    = 0xfffffff9
+
+NAMES = [
+    'initial SP', 'Reset', 'NMI', 'HardFault', 'MemManage', 'BusFault',
+    'UsageFault', None, None, None, None, 'SVC', 'DebugMon', None, 'PendSV',
+    'SysTick', 'POWER_CLOCK', 'RADIO', 'UARTE0_UART0', 'SPI0_TWI0',
+    'SPI1_TWI1', 'NFCT', 'GPIOTE', 'SAADC', 'TIMER0', 'TIMER1', 'TIMER2',
+    'RTC0', 'TEMP', 'RNG', 'ECB', 'CCM_AAR', 'WDT', 'RTC1', 'QDEC',
+    'COMP_LPCOMP', 'SWI0_EGU0', 'SWI1_EGU1', 'SWI2_EGU2', 'SWI3_EGU3',
+    'SWI4_EGU4', 'SWI5_EGU5', 'TIMER3', 'TIMER4', 'PWM0', 'PDM', None, None,
+    'MWU', 'PWM1', 'PWM2', 'SPI2', 'RTC2', 'I2S', 'FPU',
+]
+
+
+def read_elf(path):
+    '''
+    Read a 32-bit little endian ELF file. Returns the loadable segments as a
+    list of (address, data) and the symbols as a dict of name: (value, size).
+    '''
+    data = open(path, 'rb').read()
+    if data[:4] != b'\x7fELF' or data[4:6] != b'\x01\x01':
+        raise ValueError('not a 32-bit little endian ELF file: %s' % path)
+    e_phoff, e_shoff = struct.unpack_from('<II', data, 28)
+    e_phentsize, e_phnum, e_shentsize, e_shnum = struct.unpack_from('<HHHH', data, 42)
+
+    segments = []
+    for i in range(e_phnum):
+        p_type, p_offset, p_vaddr, p_paddr, p_filesz = struct.unpack_from('<IIIII', data, e_phoff + i * e_phentsize)
+        if p_type == 1 and p_filesz: # PT_LOAD
+            segments.append((p_paddr, data[p_offset:p_offset+p_filesz]))
+
+    symbols = {}
+    sections = [struct.unpack_from('<IIIIIIIIII', data, e_shoff + i * e_shentsize) for i in range(e_shnum)]
+    for sh_name, sh_type, sh_flags, sh_addr, sh_offset, sh_size, sh_link, sh_info, sh_addralign, sh_entsize in sections:
+        if sh_type != 2: # SHT_SYMTAB
+            continue
+        strtab_offset = sections[sh_link][4]
+        for offset in range(sh_offset, sh_offset + sh_size, sh_entsize):
+            st_name, st_value, st_size = struct.unpack_from('<III', data, offset)
+            end = data.index(b'\0', strtab_offset + st_name)
+            name = data[strtab_offset + st_name:end].decode('utf-8')
+            if name:
+                symbols[name] = (st_value, st_size)
+    return segments, symbols
+
+
+class Machine:
+    def __init__(self, segments, wait_states):
+        self.wait_states = wait_states
+        self.uc = unicorn.Uc(unicorn.UC_ARCH_ARM, unicorn.UC_MODE_THUMB | unicorn.UC_MODE_MCLASS)
+        self.uc.mem_map(0, FLASH_SIZE)
+        self.uc.mem_write(0, b'\xff' * FLASH_SIZE) # erased flash
+        self.uc.mem_map(0x10000000, 0x2000) # FICR, UICR
+        self.uc.mem_write(0x10000000, b'\xff' * 0x2000) # unprogrammed, like flash
+        self.uc.mem_map(RAM_BASE, RAM_SIZE)
+        self.uc.mem_map(0x40000000, 0x100000) # peripherals, all registers read 0
+        self.uc.mem_map(0xe0000000, 0x100000) # private peripheral bus (DWT etc.)
+        self.uc.mem_map(MARKER_SD, MARKER_SIZE)
+        for address, data in segments:
+            self.uc.mem_write(address, data)
+
+        # Vector tables of the SoftDevice and the application, where every
+        # entry points to its own marker.
+        for i in range(len(NAMES)):
+            self.uc.mem_write(SD_CODE_BASE + i * 4, struct.pack('<I', (MARKER_SD + i * 4) | 1))
+            self.uc.mem_write(APP_CODE_BASE + i * 4, struct.pack('<I', (MARKER_APP + i * 4) | 1))
+
+        self.uc.hook_add(unicorn.UC_HOOK_CODE, self._hook_code)
+        self.uc.hook_add(unicorn.UC_HOOK_MEM_READ | unicorn.UC_HOOK_MEM_WRITE, self._hook_mem)
+
+    def _hook_code(self, uc, address, size, user_data):
+        if self.next_pc is not None and address != self.next_pc:
+            self.cycles += 2 # taken branch
+        if MARKER_SD <= address < MARKER_SD + MARKER_SIZE:
+            self.target = address
+            uc.emu_stop()
+            return
+        self.instructions += 1
+        self.cycles += 1
+        self.next_pc = address + size
+
+    def _hook_mem(self, uc, access, address, size, value, user_data):
+        self.cycles += 1
+        if address < FLASH_SIZE:
+            self.cycles += self.wait_states
+
+    def run(self, pc, sp, lr):
+        '''
+        Run from pc until a marker is reached. Returns (target, instructions,
+        cycles), where target is None when no marker was reached.
+        '''
+        self.instructions = 0
+        self.cycles = 0
+        self.next_pc = None
+        self.target = None
+        self.uc.reg_write(arm_const.UC_ARM_REG_SP, sp)
+        self.uc.reg_write(arm_const.UC_ARM_REG_LR, lr)
+        try:
+            self.uc.emu_start(pc | 1, 0xffffffff, count=10000)
+        except unicorn.UcError:
+            pass
+        return self.target, self.instructions, self.cycles
+
+
+def describe(target):
+    if target is None:
+        return '-'
+    if target >= MARKER_APP:
+        return 'app %s' % NAMES[(target - MARKER_APP) // 4]
+    return 'SD %s' % NAMES[(target - MARKER_SD) // 4]
+
+
+def bench(path, wait_states, max_cycles):
+    segments, symbols = read_elf(path)
+    if '__Vectors' not in symbols:
+        raise ValueError('no __Vectors symbol in %s' % path)
+    vectors_addr, vectors_size = symbols['__Vectors']
+    machine = Machine(segments, wait_states)
+    vectors = struct.unpack('<%dI' % (vectors_size // 4), bytes(machine.uc.mem_read(vectors_addr, vectors_size)))
+    stack = vectors[0]
+    fail = False
+
+    # Boot into the application: the fast path in Reset_Handler. It ends at
+    # the SoftDevice reset handler.
+    target, instructions, cycles = machine.run(vectors[1], stack, 0xffffffff)
+    print('%-14s %-18s %6s %6s' % ('vector', 'forwarded to', 'instrs', 'cycles'))
+    print('%-14s %-18s %6d %6d' % ('Reset (boot)', describe(target), instructions, cycles))
+
+    # Interrupts while the application is running. They get an exception
+    # stack frame, where the stacked pc points just after an svc instruction
+    # (for SVC_Handler).
+    svc_return = MARKER_SD + MARKER_SIZE - 4
+    machine.uc.mem_write(svc_return - 2, struct.pack('<H', 0xdf10)) # svc 0x10
+    frame = stack - 32
+    machine.uc.mem_write(frame, struct.pack('<8I', 0, 0, 0, 0, 0, 0, svc_return, 0x01000000))
+    forwarded = []
+    for i in range(2, len(vectors)):
+        handler = vectors[i]
+        if not handler & 1 or (handler & ~1) >= FLASH_SIZE:
+            continue # not a Thumb function in flash, so not a forwarder
+        machine.uc.mem_write(RAM_BASE, struct.pack('<I', SD_CODE_BASE)) # MBR_VECTOR_TABLE
+        target, instructions, cycles = machine.run(handler, frame, EXC_RETURN)
+        if target is None:
+            continue # handled by the DFU itself (e.g. a fault handler)
+        name = NAMES[i] if i < len(NAMES) and NAMES[i] else str(i)
+        print('%-14s %-18s %6d %6d' % (name, describe(target), instructions, cycles))
+        forwarded.append(cycles)
+        if max_cycles is not None and cycles > max_cycles:
+            fail = True
+
+    if forwarded:
+        print('forwarded %d interrupts: min %d, max %d, average %.1f cycles' % (
+            len(forwarded), min(forwarded), max(forwarded), sum(forwarded) / float(len(forwarded))))
+    else:
+        print('no interrupts are forwarded by this build')
+    return not fail
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Benchmark DFU interrupt forwarding in an emulator')
+    parser.add_argument('-w', '--wait-states', type=int, default=0, help='Flash wait states per data access')
+    parser.add_argument('--max-cycles', type=int, help='Fail when forwarding an interrupt takes more cycles')
+    parser.add_argument('elf', nargs='?', default='build/dfu.elf', help='DFU ELF file')
+    args = parser.parse_args()
+    if not bench(args.elf, args.wait_states, args.max_cycles):
+        sys.exit(1)
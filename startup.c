@@ -25,6 +25,7 @@
 #include <stdint.h>
 #include "nrf52.h"
 #include "nrf_nvic.h"
+#include "dfu.h"
 
 extern uint32_t _estack;
 extern uint32_t _sidata;
@@ -32,6 +33,8 @@ extern uint32_t _sdata;
 extern uint32_t _edata;
 extern uint32_t _sbss;
 extern uint32_t _ebss;
+extern uint32_t _sdfu_bss;
+extern uint32_t _edfu_bss;
 
 typedef void (*func)(void);
 
@@ -66,6 +69,40 @@ void Default_Handler(void) {
 void HardFault_Handler (void) __attribute__ ((weak, alias("Default_Handler")));
 #endif
 
+// Copy and clear RAM in blocks of 16 bytes using LDM/STM. The linker
+// script aligns all sections that are initialized this way to 16 bytes.
+void ram_copy(uint32_t *dst, const uint32_t *src, const uint32_t *end) {
+    __asm__ __volatile__(
+            "1:\n"
+            "cmp   %[dst], %[end]\n"
+            "bhs   2f\n"
+            "ldmia %[src]!, {r2-r5}\n"
+            "stmia %[dst]!, {r2-r5}\n"
+            "b     1b\n"
+            "2:\n"
+            : [dst]"+r" (dst),
+              [src]"+r" (src)
+            : [end]"r" (end)
+            : "r2", "r3", "r4", "r5", "cc", "memory");
+}
+
+void ram_zero(uint32_t *dst, const uint32_t *end) {
+    __asm__ __volatile__(
+            "movs  r2, #0\n"
+            "movs  r3, #0\n"
+            "movs  r4, #0\n"
+            "movs  r5, #0\n"
+            "1:\n"
+            "cmp   %[dst], %[end]\n"
+            "bhs   2f\n"
+            "stmia %[dst]!, {r2-r5}\n"
+            "b     1b\n"
+            "2:\n"
+            : [dst]"+r" (dst)
+            : [end]"r" (end)
+            : "r2", "r3", "r4", "r5", "cc", "memory");
+}
+
 void Reset_Handler(void) {
 #if 0
     // RAMON and RAMONB registers. These are the default values (after
@@ -83,20 +120,34 @@ void Reset_Handler(void) {
     ram_on_b_addr = 1 << 17;
 #endif
 
+#if BOOT_PROFILING
+    // The cycle counter keeps running across a system reset, so start it
+    // from zero here.
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    dfu_retained.boot_cycles[BOOT_STAMP_RAM_INIT] = 0;
+    dfu_retained.boot_cycles[BOOT_STAMP_JUMP] = 0;
+#endif
+
+#if RAM_VECTORS
+    // Interrupts are forwarded using this table from now on, both in DFU
+    // mode and by the application.
+    ram_vectors_init();
+#endif
+
+    // Start the application if there is one and DFU mode wasn't requested.
+    // This doesn't return in that case, and RAM is left untouched.
+    boot_app_if_valid();
+
     // Initialize .data segment.
-    uint32_t * p_src  = &_sidata;
-    uint32_t * p_dest = &_sdata;
+    ram_copy(&_sdata, &_sidata, &_edata);
 
-    while (p_dest < &_edata) {
-      *p_dest++ = *p_src++;
-    }
+    // Initialize .bss segment. The larger buffers are in .dfu_bss, which
+    // is only cleared when DFU mode is entered.
+    ram_zero(&_sbss, &_ebss);
 
-    // Initialize .bss segment.
-    uint32_t * p_bss     = &_sbss;
-    uint32_t * p_bss_end = &_ebss;
-    while (p_bss < p_bss_end) {
-        *p_bss++ = 0ul;
-    }
+    BOOT_STAMP(BOOT_STAMP_RAM_INIT);
 
     _start();
 }
@@ -163,7 +214,7 @@ const func __Vectors[] __attribute__ ((section(".isr_vector"),used)) = {
     // selecting readonly literals). This to ensure that even if an
     // interrupt gets called here, the CPU will fault (as function
     // pointers must always have the lowest bit set in Thumb mode).
-#if defined(DFU_TYPE_mbr)
+#if defined(DFU_TYPE_mbr) || IRQ_MODEL
     MemoryManagement_Handler,
     BusFault_Handler,
     UsageFault_Handler,